@@ -0,0 +1,72 @@
+#!/bin/sh
+# In The Name Of God
+# ========================================
+# [] File Name : bench.sh
+#
+# [] Creation Date : 18-10-2026
+#
+# [] Created By : Parham Alvani (parham.alvani@gmail.com)
+# =======================================
+#
+# Overhead of the BPF backend. Runs the same loopback workloads with no
+# backend and with the BPF loader, and reports throughput, connection
+# rate and the system + softirq CPU they cost. Needs root, iperf3 and
+# netperf.
+#
+# The kernel module is not part of the comparison: it needs jprobes and
+# proc_net_fops_create(), gone since 4.15 and 3.10, while the loader
+# needs fentry and BTF from 5.5 on. No kernel runs both.
+
+set -e
+
+DURATION=${DURATION:-20}
+LOADER=${LOADER:-./tcp_flow_spy_loader}
+
+# sys + softirq jiffies and total jiffies from the first line of /proc/stat
+cpu_sample() {
+	awk '/^cpu / { print $4 + $8, $2 + $3 + $4 + $5 + $6 + $7 + $8 }' /proc/stat
+}
+
+cpu_percent() {
+	echo "$1 $2" | awk '{ printf "%.1f", 100 * ($3 - $1) / ($4 - $2) }'
+}
+
+# Bulk transfer: few flows, many packets
+stream() {
+	iperf3 -c 127.0.0.1 -t "$DURATION" -f g |
+		awk '/sender/ { print $(NF - 3) " Gbit/s" }'
+}
+
+# Connect, request, response, close: one flow per transaction
+crr() {
+	netperf -H 127.0.0.1 -t TCP_CRR -l "$DURATION" -P 0 |
+		awk 'NF { print $NF " trans/s" }'
+}
+
+run() {
+	name=$1
+	workload=$2
+
+	before=$(cpu_sample)
+	result=$($workload)
+	after=$(cpu_sample)
+	printf "%-8s %-8s %-20s %s%% cpu\n" "$name" "$workload" "$result" \
+		"$(cpu_percent "$before" "$after")"
+}
+
+iperf3 -s -D > /dev/null
+netserver > /dev/null 2>&1
+
+for workload in stream crr; do
+	run none "$workload"
+
+	"$LOADER" > /dev/null &
+	loader=$!
+	sleep 1
+	run bpf "$workload"
+	kill "$loader"
+	wait "$loader" || true
+done
+
+pkill iperf3 || true
+pkill netserver || true
@@ -0,0 +1,226 @@
+/*
+ * In The Name Of God
+ * ========================================
+ * [] File Name : tcp_flow_spy.bpf.c
+ *
+ * [] Creation Date : 18-10-2026
+ *
+ * [] Created By : Parham Alvani (parham.alvani@gmail.com)
+ * =======================================
+*/
+/*
+ * tcpflowspy BPF backend - the logic of jtcp_v4_do_rcv and jtcp_close
+ * as CO-RE programs, so one object runs on every BTF enabled kernel.
+ *
+ * Live flows sit in an LRU hash, so a full table evicts the coldest flow
+ * instead of refusing new ones. Finished flows are pushed to a ring
+ * buffer and read by tcp_flow_spy_loader.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_endian.h>
+
+#include "tcp_flow_spy_bpf.h"
+
+#define TCPF_CLOSE	(1 << 7)
+#define TCPF_CLOSING	(1 << 11)
+#define TCPF_TIME_WAIT	(1 << 6)
+#define TCPF_LAST_ACK	(1 << 9)
+#define TCP_ESTABLISHED	1
+
+#define FINISHED_STATES \
+	(TCPF_CLOSE|TCPF_CLOSING|TCPF_TIME_WAIT|TCPF_LAST_ACK)
+
+char LICENSE[] SEC("license") = "GPL";
+
+/* Set by the loader before load, same meaning as the module parameters */
+const volatile __u16 port = 0;
+const volatile __u32 bucket_length = 1;
+const volatile __u32 sample_ms = 100;
+
+#define sample_ns ((__u64) sample_ms * 1000000ULL)
+
+/* Too big for the stack, new flows are inserted as a copy of this */
+static const struct flow_record zero_record = {};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 4096);
+	__type(key, struct flow_key);
+	__type(value, struct flow_record);
+} flows SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 256 * 1024);
+} finished SEC(".maps");
+
+static __always_inline int is_finished(const struct sock *sk)
+{
+	return (1 << BPF_CORE_READ(sk, __sk_common.skc_state)) &
+		FINISHED_STATES;
+}
+
+static __always_inline int port_matches(__u16 sport, __u16 dport)
+{
+	return port == 0 || bpf_ntohs(sport) == port ||
+		bpf_ntohs(dport) == port;
+}
+
+/* Moves the ring on to the bin now falls in, like the module does */
+static __always_inline struct flow_sample *current_sample(
+		struct flow_record *p, __u64 now)
+{
+	if (now >= p->sample_end) {
+		__u64 skipped = (now - p->sample_end) / sample_ns + 1;
+		__u32 i;
+
+		for (i = 1; i <= SAMPLE_BINS && i <= skipped; i++)
+			__builtin_memset(&p->samples[(p->sample_index + i) &
+					(SAMPLE_BINS - 1)], 0,
+					sizeof(struct flow_sample));
+		p->sample_index += skipped;
+		p->sample_end += skipped * sample_ns;
+	}
+	return &p->samples[p->sample_index & (SAMPLE_BINS - 1)];
+}
+
+static __always_inline void finish_flow(struct flow_key *key)
+{
+	struct flow_record *p = bpf_map_lookup_elem(&flows, key);
+
+	if (!p)
+		return;
+	bpf_ringbuf_output(&finished, p, sizeof(*p), 0);
+	bpf_map_delete_elem(&flows, key);
+}
+
+SEC("fentry/tcp_v4_do_rcv")
+int BPF_PROG(tcp_v4_do_rcv, struct sock *sk, struct sk_buff *skb)
+{
+	const struct tcp_sock *tp = (const struct tcp_sock *) sk;
+	unsigned char *head = BPF_CORE_READ(skb, head);
+	struct flow_sample *bin = NULL;
+	struct flow_record *p;
+	struct flow_key key = {};
+	struct tcphdr th;
+	struct iphdr iph;
+	__u64 now = bpf_ktime_get_ns();
+	__u32 seq;
+
+	if (bpf_probe_read_kernel(&iph, sizeof(iph),
+				head + BPF_CORE_READ(skb, network_header)) ||
+	    bpf_probe_read_kernel(&th, sizeof(th),
+				head + BPF_CORE_READ(skb, transport_header)))
+		return 0;
+
+	/* Only update if port matches */
+	if (!port_matches(th.source, th.dest))
+		return 0;
+
+	key.saddr = iph.saddr;
+	key.daddr = iph.daddr;
+	key.sport = th.source;
+	key.dport = th.dest;
+
+	p = bpf_map_lookup_elem(&flows, &key);
+	if (!p) {
+		if (!th.syn)
+			return 0;
+
+		if (bpf_map_update_elem(&flows, &key, &zero_record,
+					BPF_NOEXIST))
+			return 0;
+
+		p = bpf_map_lookup_elem(&flows, &key);
+		if (!p)
+			return 0;
+
+		p->first_packet_tstamp = now;
+		p->saddr = key.saddr;
+		p->daddr = key.daddr;
+		p->sport = key.sport;
+		p->dport = key.dport;
+		p->sample_end = now + sample_ns;
+	}
+
+	/*
+	 * Packets of one flow are handled under the socket lock, so plain
+	 * updates race only with the loader reading a live snapshot.
+	 */
+	p->last_packet_tstamp = now;
+	p->recv_count++;
+	p->recv_size += BPF_CORE_READ(skb, len);
+
+	if (sample_ms) {
+		bin = current_sample(p, now);
+		bin->bytes_in += BPF_CORE_READ(skb, len);
+	}
+	p->buff_size = BPF_CORE_READ(sk, sk_wmem_queued);
+	p->max_buff_size = BPF_CORE_READ(sk, sk_sndbuf);
+
+	seq = bpf_ntohl(th.seq);
+	if (seq >= p->last_recv_seq)
+		p->last_recv_seq = seq;
+	else
+		p->out_of_order_packets++;
+
+	if (BPF_CORE_READ(sk, __sk_common.skc_state) == TCP_ESTABLISHED) {
+		__u32 cwnd = BPF_CORE_READ(tp, snd_cwnd);
+		__u32 snd_nxt = BPF_CORE_READ(tp, snd_nxt);
+		__u32 cwnd_index = cwnd / bucket_length;
+
+		if (cwnd_index > NUMBER_OF_BUCKETS - 1)
+			cwnd_index = NUMBER_OF_BUCKETS - 1;
+		p->snd_cwnd_histogram[cwnd_index]++;
+		p->last_cwnd = cwnd;
+		p->snd_cwnd_clamp = BPF_CORE_READ(tp, snd_cwnd_clamp);
+		/* tcp_current_ssthresh() is inline, report the raw value */
+		p->ssthresh = BPF_CORE_READ(tp, snd_ssthresh);
+		p->srtt = BPF_CORE_READ(tp, srtt_us) >> 3;
+		p->rto = BPF_CORE_READ(&tp->inet_conn, icsk_rto);
+		p->rttvar = BPF_CORE_READ(tp, rttvar_us);
+
+		if (bin) {
+			bin->snd_cwnd = p->last_cwnd;
+			bin->srtt = p->srtt;
+			/* Retransmissions before we saw the flow are not its */
+			if (p->last_snd_seq)
+				bin->retransmissions +=
+					BPF_CORE_READ(tp, total_retrans) -
+					p->total_retransmissions;
+		}
+
+		p->total_retransmissions = BPF_CORE_READ(tp, total_retrans);
+		if (p->last_snd_seq && snd_nxt > p->last_snd_seq) {
+			p->snd_size += snd_nxt - p->last_snd_seq;
+			if (bin)
+				bin->bytes_out += snd_nxt - p->last_snd_seq;
+		}
+
+		p->last_snd_seq = snd_nxt;
+	}
+
+	if (is_finished(sk) || th.rst)
+		finish_flow(&key);
+
+	return 0;
+}
+
+SEC("fentry/tcp_close")
+int BPF_PROG(tcp_close, struct sock *sk, long timeout)
+{
+	struct flow_key key = {};
+
+	/* Received packets are keyed remote side first */
+	key.saddr = BPF_CORE_READ(sk, __sk_common.skc_daddr);
+	key.daddr = BPF_CORE_READ(sk, __sk_common.skc_rcv_saddr);
+	key.sport = BPF_CORE_READ(sk, __sk_common.skc_dport);
+	key.dport = bpf_htons(BPF_CORE_READ(sk, __sk_common.skc_num));
+
+	if (port_matches(key.sport, key.dport))
+		finish_flow(&key);
+	return 0;
+}
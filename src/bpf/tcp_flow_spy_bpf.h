@@ -0,0 +1,70 @@
+/*
+ * In The Name Of God
+ * ========================================
+ * [] File Name : tcp_flow_spy_bpf.h
+ *
+ * [] Creation Date : 18-10-2026
+ *
+ * [] Created By : Parham Alvani (parham.alvani@gmail.com)
+ * =======================================
+*/
+/*
+ * Types shared between the BPF programs and their loader. The record
+ * carries the fields of struct tcp_flow_log that tcpflowspy_sprint
+ * exports, so the loader prints exactly what /proc/net/tcpflowspy does.
+ */
+#ifndef TCP_FLOW_SPY_BPF_H
+#define TCP_FLOW_SPY_BPF_H
+
+#define NUMBER_OF_BUCKETS   10
+
+/* Same as SAMPLE_BINS of the module, a power of two */
+#define SAMPLE_BINS 16
+
+/* Same as EXPIRE_SKB of the module */
+#define EXPIRE_NS (2ULL * 60 * 1000000000ULL)
+
+/* Addresses and ports in network order, remote side first */
+struct flow_key {
+	__u32 saddr, daddr;
+	__u16 sport, dport;
+};
+
+/* Same layout as struct tcpflowspy_sample */
+struct flow_sample {
+	__u32 bytes_in;
+	__u32 bytes_out;
+	__u32 retransmissions;
+	__u32 snd_cwnd;
+	__u32 srtt;
+};
+
+struct flow_record {
+	__u64 first_packet_tstamp;
+	__u64 last_packet_tstamp;
+	__u32 saddr, daddr;
+	__u16 sport, dport;
+	__u32 recv_count;
+	__u64 recv_size;
+	__u64 snd_size;
+	__u32 last_recv_seq;
+	__u32 last_snd_seq;
+	__u32 out_of_order_packets;
+	__u32 total_retransmissions;
+	__u32 snd_cwnd_clamp;
+	__u32 ssthresh;
+	__u32 srtt;
+	__u32 rttvar;
+	__u32 last_cwnd;
+	__u32 rto;
+	__u32 buff_size;
+	__u32 max_buff_size;
+	__u32 snd_cwnd_histogram[NUMBER_OF_BUCKETS];
+	/* Ring of the last SAMPLE_BINS bins, see current_sample() */
+	struct flow_sample samples[SAMPLE_BINS];
+	/* Number of the bin being filled and the time it ends */
+	__u32 sample_index;
+	__u64 sample_end;
+};
+
+#endif
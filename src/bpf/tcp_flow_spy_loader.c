@@ -0,0 +1,334 @@
+/*
+ * In The Name Of God
+ * ========================================
+ * [] File Name : tcp_flow_spy_loader.c
+ *
+ * [] Creation Date : 18-10-2026
+ *
+ * [] Created By : Parham Alvani (parham.alvani@gmail.com)
+ * =======================================
+*/
+/*
+ * Loads the tcpflowspy BPF programs and prints flow records in the
+ * format of /proc/net/tcpflowspy, so existing collectors can read either
+ * backend.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "tcp_flow_spy_bpf.h"
+#include "tcp_flow_spy.skel.h"
+
+#define POLL_TIMEOUT_MS 100
+#define LIVE_INTERVAL_NS (1000000000ULL)
+#define PRINTED_BUCKETS 4096
+
+static volatile sig_atomic_t exiting;
+static unsigned long long real_offset;
+static unsigned int sample_ms = 100;
+
+/*
+ * What the loader printed of a live flow. Kept here and not in the map:
+ * the programs keep updating the record, and writing it back from here
+ * would lose their updates.
+ */
+struct printed {
+	struct flow_key key;
+	unsigned long long tstamp;
+	/* Last live pass that still found the flow in the map */
+	unsigned long long pass;
+	struct printed *next;
+};
+
+static struct printed *printed[PRINTED_BUCKETS];
+
+static void sig_handler(int sig)
+{
+	exiting = 1;
+}
+
+static unsigned long long clock_ns(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Must stay in sync with tcpflowspy_sprint() of the module */
+static void print_record(const struct flow_record *p, int finished,
+		unsigned long long now)
+{
+	unsigned long long duration =
+		p->last_packet_tstamp - p->first_packet_tstamp;
+	unsigned int first, i;
+
+	printf("%llu (%d) %x:%u %x:%u %lu.%09lu %u %lu %lu %u %u %u %u %u %u %u %u %u %u,%u,%u,%u,%u,%u,%u,%u,%u,%u",
+			now + real_offset,
+			finished,
+			ntohl(p->saddr), ntohs(p->sport),
+			ntohl(p->daddr), ntohs(p->dport),
+			(unsigned long) (duration / 1000000000ULL),
+			(unsigned long) (duration % 1000000000ULL),
+			p->recv_count,
+			(unsigned long) p->recv_size,
+			(unsigned long) p->snd_size,
+			p->total_retransmissions,
+			p->out_of_order_packets, p->snd_cwnd_clamp,
+			p->ssthresh, p->srtt, p->rto, p->last_cwnd,
+			p->buff_size, p->max_buff_size,
+			p->snd_cwnd_histogram[0], p->snd_cwnd_histogram[1],
+			p->snd_cwnd_histogram[2], p->snd_cwnd_histogram[3],
+			p->snd_cwnd_histogram[4], p->snd_cwnd_histogram[5],
+			p->snd_cwnd_histogram[6], p->snd_cwnd_histogram[7],
+			p->snd_cwnd_histogram[8], p->snd_cwnd_histogram[9]);
+
+	if (sample_ms) {
+		first = p->sample_index >= SAMPLE_BINS ?
+			p->sample_index - SAMPLE_BINS + 1 : 0;
+		printf(" %u:%u", sample_ms, first);
+		for (i = first; i <= p->sample_index; i++) {
+			const struct flow_sample *bin =
+				&p->samples[i & (SAMPLE_BINS - 1)];
+
+			printf("%c%u/%u/%u/%u/%u", i == first ? ' ' : ',',
+					bin->bytes_in, bin->bytes_out,
+					bin->retransmissions, bin->snd_cwnd,
+					bin->srtt);
+		}
+	}
+	printf(" \n");
+}
+
+static struct printed **printed_slot(const struct flow_key *key)
+{
+	unsigned int h = key->saddr ^ key->daddr ^
+		((unsigned int) key->sport << 16 | key->dport);
+	struct printed **pp;
+
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+
+	pp = &printed[h & (PRINTED_BUCKETS - 1)];
+	while (*pp && memcmp(&(*pp)->key, key, sizeof(*key)))
+		pp = &(*pp)->next;
+	return pp;
+}
+
+static struct printed *printed_get(const struct flow_key *key)
+{
+	struct printed **pp = printed_slot(key);
+
+	if (!*pp) {
+		*pp = calloc(1, sizeof(**pp));
+		if (!*pp)
+			return NULL;
+		(*pp)->key = *key;
+	}
+	return *pp;
+}
+
+static void printed_forget(const struct flow_key *key)
+{
+	struct printed **pp = printed_slot(key);
+	struct printed *p = *pp;
+
+	if (p) {
+		*pp = p->next;
+		free(p);
+	}
+}
+
+/* Forgets flows the map no longer has, e.g. evicted by the LRU */
+static void printed_sweep(unsigned long long pass)
+{
+	int i;
+
+	for (i = 0; i < PRINTED_BUCKETS; i++) {
+		struct printed **pp = &printed[i];
+
+		while (*pp) {
+			struct printed *p = *pp;
+
+			if (p->pass == pass) {
+				pp = &p->next;
+				continue;
+			}
+			*pp = p->next;
+			free(p);
+		}
+	}
+}
+
+static int handle_finished(void *ctx, void *data, size_t size)
+{
+	const struct flow_record *rec = data;
+	struct flow_key key = {};
+
+	if (size < sizeof(struct flow_record))
+		return 0;
+	print_record(rec, 1, clock_ns(CLOCK_MONOTONIC));
+
+	key.saddr = rec->saddr;
+	key.daddr = rec->daddr;
+	key.sport = rec->sport;
+	key.dport = rec->dport;
+	printed_forget(&key);
+	return 0;
+}
+
+/*
+ * Same policy as get_next_live_log_for_print(): print flows that moved
+ * since the last time, and finish flows idle for longer than EXPIRE_NS.
+ * Like the module, an expired flow leaves the map, so it is reported
+ * once and its close finds nothing left to report again.
+ */
+static void print_live(int map_fd, unsigned long long now)
+{
+	static unsigned long long pass;
+	struct flow_key key, next;
+	struct flow_record rec;
+	int more = bpf_map_get_next_key(map_fd, NULL, &next) == 0;
+
+	pass++;
+	while (more) {
+		struct printed *p;
+
+		key = next;
+		more = bpf_map_get_next_key(map_fd, &key, &next) == 0;
+
+		if (bpf_map_lookup_elem(map_fd, &key, &rec))
+			continue;
+
+		if (now - rec.last_packet_tstamp > EXPIRE_NS) {
+			/* A close that beat us put it in the ring */
+			if (!bpf_map_delete_elem(map_fd, &key))
+				print_record(&rec, 1, now);
+			printed_forget(&key);
+			continue;
+		}
+
+		p = printed_get(&key);
+		if (!p)
+			continue;
+		p->pass = pass;
+
+		if (rec.last_packet_tstamp > p->tstamp) {
+			print_record(&rec, 0, now);
+			p->tstamp = now;
+		}
+	}
+	printed_sweep(pass);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-p port] [-b bucket_length] [-s sample_ms] [-l]\n"
+		"  -p  port to match (0=all)\n"
+		"  -b  length of each bucket in the histogram (1)\n"
+		"  -s  width of the throughput sample bins in ms (100, 0=off)\n"
+		"  -l  also print live flows\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct tcp_flow_spy_bpf *skel;
+	struct ring_buffer *rb = NULL;
+	unsigned long long last_live = 0;
+	int live = 0;
+	int err = 0;
+	int opt;
+
+	skel = tcp_flow_spy_bpf__open();
+	if (!skel) {
+		fprintf(stderr, "failed to open BPF object\n");
+		return 1;
+	}
+
+	while ((opt = getopt(argc, argv, "p:b:s:lh")) != -1) {
+		switch (opt) {
+		case 'p':
+			skel->rodata->port = atoi(optarg);
+			break;
+		case 'b':
+			skel->rodata->bucket_length = atoi(optarg);
+			break;
+		case 's':
+			sample_ms = atoi(optarg);
+			break;
+		case 'l':
+			live = 1;
+			break;
+		default:
+			usage(argv[0]);
+			err = 1;
+			goto cleanup;
+		}
+	}
+
+	if (skel->rodata->bucket_length == 0) {
+		usage(argv[0]);
+		err = 1;
+		goto cleanup;
+	}
+	skel->rodata->sample_ms = sample_ms;
+
+	err = tcp_flow_spy_bpf__load(skel);
+	if (err) {
+		fprintf(stderr, "failed to load BPF object: %d\n", err);
+		goto cleanup;
+	}
+
+	err = tcp_flow_spy_bpf__attach(skel);
+	if (err) {
+		fprintf(stderr, "failed to attach BPF programs: %d\n", err);
+		goto cleanup;
+	}
+
+	rb = ring_buffer__new(bpf_map__fd(skel->maps.finished),
+			handle_finished, NULL, NULL);
+	if (!rb) {
+		err = -errno;
+		fprintf(stderr, "failed to create ring buffer: %d\n", err);
+		goto cleanup;
+	}
+
+	real_offset = clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC);
+
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	while (!exiting) {
+		unsigned long long now;
+
+		err = ring_buffer__poll(rb, POLL_TIMEOUT_MS);
+		if (err < 0 && err != -EINTR) {
+			fprintf(stderr, "failed to poll ring buffer: %d\n", err);
+			break;
+		}
+		err = 0;
+
+		now = clock_ns(CLOCK_MONOTONIC);
+		if (live && now - last_live >= LIVE_INTERVAL_NS) {
+			print_live(bpf_map__fd(skel->maps.flows), now);
+			last_live = now;
+		}
+	}
+
+cleanup:
+	ring_buffer__free(rb);
+	tcp_flow_spy_bpf__destroy(skel);
+	return err != 0;
+}
@@ -40,11 +40,21 @@
 #include <linux/tcp.h>
 #include <linux/slab.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/topology.h>
+#include <linux/mutex.h>
+#include <linux/random.h>
+#include <linux/hash.h>
 #include <linux/module.h>
 #include <linux/time.h>
 #include <linux/ktime.h>
 #include <linux/delay.h>
+#include <linux/rcupdate.h>
 #include <net/tcp.h>
+#include <net/genetlink.h>
+#include <net/inet_hashtables.h>
 
 #include "tcp_flow_spy.h"
 
@@ -71,46 +81,151 @@ static int live __read_mostly;
 MODULE_PARM_DESC(live, "(0) stats of completed flows are printed, (1) stats of live flows are printed.");
 module_param(live, int, 0);
 
-static struct tcp_flow_log *last_printed_flow_log;
+static unsigned int sample_ms __read_mostly = 100;
+MODULE_PARM_DESC(sample_ms, "Width of the per flow throughput sample bins in ms (100), 0 disables them.");
+module_param(sample_ms, uint, 0);
+
+static u64 sample_ns __read_mostly;
+
+static int overflow __read_mostly = OVERFLOW_DROP;
+MODULE_PARM_DESC(overflow, "When the export buffer is full: (0) keep finished flows in the pool until read, (1) drop the oldest exported flow, (2) fold the oldest exported flow into per-port aggregates.");
+module_param(overflow, int, 0);
+
+static int clock __read_mostly;
+MODULE_PARM_DESC(clock, "Packet timestamps: (0) monotonic clock, (1) coarse monotonic clock, (2) skb receive timestamp when present.");
+module_param(clock, int, 0);
+
+static unsigned int exportsize __read_mostly = 256 * 1024;
+MODULE_PARM_DESC(exportsize, "Buffer of packed finished flows in bytes (262144)");
+module_param(exportsize, uint, 0);
+
+static int netlink __read_mostly = 1;
+MODULE_PARM_DESC(netlink, "(1) flows are also multicast over generic netlink, (0) only the proc file.");
+module_param(netlink, int, 0);
+
+static unsigned int netlink_flush_ms __read_mostly = 100;
+MODULE_PARM_DESC(netlink_flush_ms, "Longest time a flow waits in a netlink batch in ms (100)");
+module_param(netlink_flush_ms, uint, 0);
+
+static int bootstrap __read_mostly = 1;
+MODULE_PARM_DESC(bootstrap, "Pick up connections established before load (1)");
+module_param(bootstrap, int, 0);
+
+static unsigned int bootstrap_batch __read_mostly = 256;
+MODULE_PARM_DESC(bootstrap_batch, "Hash buckets walked per bootstrap run (256)");
+module_param(bootstrap_batch, uint, 0);
+
+static unsigned int trace_size __read_mostly = 1024;
+MODULE_PARM_DESC(trace_size, "Per CPU trace ring size in segments (1024), 0 disables tracing.");
+module_param(trace_size, uint, 0);
+
+static unsigned int trace_sample __read_mostly;
+MODULE_PARM_DESC(trace_sample, "Trace one in trace_sample new flows (0=none).");
+module_param(trace_sample, uint, 0);
+
+static int sk_key __read_mostly;
+MODULE_PARM_DESC(sk_key, "(0) flows are found by hashing the packet 4-tuple, (1) flows are found by their socket.");
+module_param(sk_key, int, 0);
 
 static const char procname[] = "tcpflowspy";
+static const char statname[] = "tcpflowspy_stat";
+static const char tracename[] = "tcpflowspy_trace";
+
+static DEFINE_MUTEX(trace_mutex);
 
-static inline struct timespec get_time(void)
+/*
+ * Every timestamp is kept as u64 nanoseconds on the monotonic clock and
+ * only turned into wall-clock time by to_real_time() when exported.
+ * Only helpers the jprobe era kernels have are used here.
+ */
+static inline u64 get_time(const struct sk_buff *skb)
 {
 	struct timespec ts;
 
-	ktime_get_real_ts(&ts);
-	return ts;
+	switch (clock) {
+	case TSTAMP_COARSE:
+		ts = get_monotonic_coarse();
+		return timespec_to_ns(&ts);
+	case TSTAMP_SKB:
+		/* skb stamps are wall-clock, only set if someone asked */
+		if (skb && ktime_to_ns(skb->tstamp))
+			return ktime_to_ns(skb->tstamp) -
+				tcp_flow_spy.real_offset;
+		break;
+	}
+	return ktime_to_ns(ktime_get());
+}
+
+static inline u64 to_real_time(u64 tstamp)
+{
+	return tstamp + tcp_flow_spy.real_offset;
+}
+
+/* Number of the oldest sample bin still in the ring */
+static inline u32 sample_first(const struct tcp_flow_log *log)
+{
+	if (!sample_ns)
+		return 0;
+	return log->sample_index >= SAMPLE_BINS ?
+		log->sample_index - SAMPLE_BINS + 1 : 0;
 }
 
+/* Number of bins in the ring, the one being filled included */
+static inline u32 sample_count(const struct tcp_flow_log *log)
+{
+	if (!sample_ns)
+		return 0;
+	return log->sample_index - sample_first(log) + 1;
+}
+
+static inline struct tcpflowspy_sample *sample_bin(
+		struct tcp_flow_log *log, u32 index)
+{
+	return &log->samples[index & (SAMPLE_BINS - 1)];
+}
+
+/* Every node that got an arena at load, whether still online or not */
+#define for_each_arena(node, arena) \
+	for ((node) = 0; (node) < nr_node_ids; (node)++) \
+		if (!((arena) = tcp_flow_spy.arenas[node])) {} else
+
+/* Caller must hold the lock of the arena of log */
 static inline void add_in_used(struct tcp_flow_log *log)
 {
+	struct tcp_flow_arena *arena;
+
 	if (unlikely(!log))
 		return;
 
 	if (log->used)
 		pr_info("error\n");
 
+	arena = tcp_flow_spy.arenas[log->node];
 	log->used = 1;
-	log->used_thread_next = tcp_flow_spy.used;
+	log->used_thread_next = arena->used;
 	log->used_thread_prev = NULL;
 
-	if (tcp_flow_spy.used)
-		tcp_flow_spy.used->used_thread_prev = log;
+	if (arena->used)
+		arena->used->used_thread_prev = log;
 
-	tcp_flow_spy.used = log;
+	arena->used = log;
 }
 
+/* Caller must hold the lock of the arena of log */
 static inline void remove_from_used(struct tcp_flow_log *log)
 {
 	if (unlikely(!log)) {
 		return;
 	} else {
+		struct tcp_flow_arena *arena = tcp_flow_spy.arenas[log->node];
 		struct tcp_flow_log *prev = log->used_thread_prev;
 		struct tcp_flow_log *next = log->used_thread_next;
 
-		if (last_printed_flow_log == log)
-			last_printed_flow_log = 0;
+		if (arena->print_next == log)
+			arena->print_next = next;
+
+		if (arena->live_next == log)
+			arena->live_next = next;
 
 		if (prev)
 			prev->used_thread_next = next;
@@ -118,13 +233,724 @@ static inline void remove_from_used(struct tcp_flow_log *log)
 		if (next)
 			next->used_thread_prev = prev;
 
-		if (log == tcp_flow_spy.used)
-			tcp_flow_spy.used = next;
+		if (log == arena->used)
+			arena->used = next;
 
 		log->used_thread_next = log->used_thread_prev = NULL;
 	}
 }
 
+/* Caller must hold tcp_flow_spy.lock, log is off the used list */
+static inline void push_finished(struct tcp_flow_log *log)
+{
+	log->prev = NULL;
+	log->next = tcp_flow_spy.finished;
+
+	if (tcp_flow_spy.finished)
+		tcp_flow_spy.finished->prev = log;
+	else
+		tcp_flow_spy.finished_tail = log;
+
+	tcp_flow_spy.finished = log;
+	tcp_flow_spy.finished_count++;
+}
+
+/* Caller must hold tcp_flow_spy.lock */
+static inline void unlink_finished(struct tcp_flow_log *log)
+{
+	if (log->prev)
+		log->prev->next = log->next;
+	else
+		tcp_flow_spy.finished = log->next;
+
+	if (log->next)
+		log->next->prev = log->prev;
+	else
+		tcp_flow_spy.finished_tail = log->prev;
+
+	log->next = log->prev = NULL;
+	tcp_flow_spy.finished_count--;
+}
+
+/* Node whose arena new flows of this CPU are taken from */
+static inline int local_node(void)
+{
+	int node = numa_node_id();
+
+	return likely(tcp_flow_spy.arenas[node]) ?
+		node : tcp_flow_spy.home_node;
+}
+
+/*
+ * Sockets found without a record may have one now, or may get one.
+ * Racing bumps can lose one, but the generation still moves on.
+ */
+static inline void forget_refused(void)
+{
+	WRITE_ONCE(tcp_flow_spy.pool_gen, tcp_flow_spy.pool_gen + 1);
+}
+
+/*
+ * Gives the record back to the arena it came from, whoever finished it.
+ * It must be off the used list already.
+ */
+static inline void release_log(struct tcp_flow_log *log)
+{
+	struct tcp_flow_arena *arena = tcp_flow_spy.arenas[log->node];
+	unsigned long flags;
+
+	spin_lock_irqsave(&arena->lock, flags);
+	/* Sockets turned away before may try again */
+	if (!arena->available)
+		forget_refused();
+
+	log->used = 0;
+	log->prev = NULL;
+	log->next = arena->available;
+	arena->available = log;
+	arena->free++;
+	spin_unlock_irqrestore(&arena->lock, flags);
+}
+
+static void release_log_rcu(struct rcu_head *head)
+{
+	release_log(container_of(head, struct tcp_flow_log, rcu));
+}
+
+/*
+ * Probes run with preemption off and may still hold a finished record,
+ * so it only goes back to the pool after a sched grace period.
+ */
+static inline void retire_log(struct tcp_flow_log *log)
+{
+	call_rcu_sched(&log->rcu, release_log_rcu);
+}
+
+/*
+ * Service port of a flow: the port we were asked to watch, otherwise
+ * the lower of the two which is the listening side most of the time.
+ */
+static inline u16 aggregate_port(const struct tcp_flow_log *log)
+{
+	if (port)
+		return port;
+	return min(ntohs(log->sport), ntohs(log->dport));
+}
+
+/* Caller must hold tcp_flow_spy.lock */
+static inline void compact_into_aggregate(const struct tcp_flow_log *log)
+{
+	struct tcp_port_aggregate *agg = &tcp_flow_spy.aggregate_other;
+	u16 key = aggregate_port(log);
+	int i = 0;
+
+	for (i = 0; i < AGGREGATE_SIZE; i++) {
+		struct tcp_port_aggregate *slot =
+			&tcp_flow_spy.aggregates[(key + i) % AGGREGATE_SIZE];
+
+		if (slot->port == key || slot->port == 0) {
+			slot->port = key;
+			agg = slot;
+			break;
+		}
+	}
+
+	agg->flows++;
+	agg->recv_count += log->recv_count;
+	agg->recv_size += log->recv_size;
+	agg->snd_size += log->snd_size;
+	agg->retransmissions += log->total_retransmissions;
+}
+
+static inline u8 *put_varint(u8 *p, u64 v)
+{
+	while (v >= 0x80) {
+		*p++ = (u8) v | 0x80;
+		v >>= 7;
+	}
+	*p++ = (u8) v;
+	return p;
+}
+
+static inline const u8 *get_varint(const u8 *p, const u8 *end, u64 *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 64) {
+		*v |= (u64) (*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+	return NULL;
+}
+
+/*
+ * Packs the exported fields of a flow: timestamps relative to load,
+ * addresses and ports as they are, every counter as a varint.
+ */
+static inline int encode_flow_log(const struct tcp_flow_log *log, u8 *buf)
+{
+	u8 *p = buf;
+	int i = 0;
+
+	p = put_varint(p, log->first_packet_tstamp - tcp_flow_spy.load_time);
+	p = put_varint(p, log->last_packet_tstamp - log->first_packet_tstamp);
+	memcpy(p, &log->saddr, sizeof(log->saddr));
+	p += sizeof(log->saddr);
+	memcpy(p, &log->daddr, sizeof(log->daddr));
+	p += sizeof(log->daddr);
+	memcpy(p, &log->sport, sizeof(log->sport));
+	p += sizeof(log->sport);
+	memcpy(p, &log->dport, sizeof(log->dport));
+	p += sizeof(log->dport);
+	p = put_varint(p, log->recv_count);
+	p = put_varint(p, log->recv_size);
+	p = put_varint(p, log->snd_size);
+	p = put_varint(p, log->total_retransmissions);
+	p = put_varint(p, log->out_of_order_packets);
+	p = put_varint(p, log->snd_cwnd_clamp);
+	p = put_varint(p, log->ssthresh);
+	p = put_varint(p, log->srtt);
+	p = put_varint(p, log->rto);
+	p = put_varint(p, log->last_cwnd);
+	p = put_varint(p, log->buff_size);
+	p = put_varint(p, log->max_buff_size);
+	for (i = 0; i < NUMBER_OF_BUCKETS; i++)
+		p = put_varint(p, log->snd_cwnd_histogram[i]);
+
+	p = put_varint(p, sample_first(log));
+	p = put_varint(p, sample_count(log));
+	for (i = sample_first(log); i <= log->sample_index && sample_ns; i++) {
+		const struct tcpflowspy_sample *bin =
+			&log->samples[i & (SAMPLE_BINS - 1)];
+
+		p = put_varint(p, bin->bytes_in);
+		p = put_varint(p, bin->bytes_out);
+		p = put_varint(p, bin->retransmissions);
+		p = put_varint(p, bin->snd_cwnd);
+		p = put_varint(p, bin->srtt);
+	}
+
+	return p - buf;
+}
+
+/* Fills the exported fields of log back in, 0 on a malformed record */
+static inline int decode_flow_log(const u8 *buf, int len,
+		struct tcp_flow_log *log)
+{
+	const u8 *p = buf, *end = buf + len;
+	u64 v[12];
+	int i = 0;
+
+	if (!(p = get_varint(p, end, &log->first_packet_tstamp)) ||
+			!(p = get_varint(p, end, &log->last_packet_tstamp)))
+		return 0;
+	log->first_packet_tstamp += tcp_flow_spy.load_time;
+	log->last_packet_tstamp += log->first_packet_tstamp;
+
+	if (end - p < 12)
+		return 0;
+	memcpy(&log->saddr, p, sizeof(log->saddr));
+	p += sizeof(log->saddr);
+	memcpy(&log->daddr, p, sizeof(log->daddr));
+	p += sizeof(log->daddr);
+	memcpy(&log->sport, p, sizeof(log->sport));
+	p += sizeof(log->sport);
+	memcpy(&log->dport, p, sizeof(log->dport));
+	p += sizeof(log->dport);
+
+	for (i = 0; i < ARRAY_SIZE(v); i++)
+		if (!(p = get_varint(p, end, &v[i])))
+			return 0;
+	log->recv_count = v[0];
+	log->recv_size = v[1];
+	log->snd_size = v[2];
+	log->total_retransmissions = v[3];
+	log->out_of_order_packets = v[4];
+	log->snd_cwnd_clamp = v[5];
+	log->ssthresh = v[6];
+	log->srtt = v[7];
+	log->rto = v[8];
+	log->last_cwnd = v[9];
+	log->buff_size = v[10];
+	log->max_buff_size = v[11];
+
+	for (i = 0; i < NUMBER_OF_BUCKETS; i++) {
+		if (!(p = get_varint(p, end, &v[0])))
+			return 0;
+		log->snd_cwnd_histogram[i] = v[0];
+	}
+
+	/* First bin and number of bins */
+	if (!(p = get_varint(p, end, &v[0])) ||
+			!(p = get_varint(p, end, &v[1])) ||
+			v[1] > SAMPLE_BINS)
+		return 0;
+	log->sample_index = v[0] + v[1] - 1;
+	for (i = 0; i < v[1]; i++) {
+		struct tcpflowspy_sample *bin = sample_bin(log, v[0] + i);
+		u64 f[5];
+		int j = 0;
+
+		for (j = 0; j < ARRAY_SIZE(f); j++)
+			if (!(p = get_varint(p, end, &f[j])))
+				return 0;
+		bin->bytes_in = f[0];
+		bin->bytes_out = f[1];
+		bin->retransmissions = f[2];
+		bin->snd_cwnd = f[3];
+		bin->srtt = f[4];
+	}
+	return 1;
+}
+
+static inline void export_write(u64 off, const u8 *src, int len)
+{
+	u32 at = off & (tcp_flow_export.size - 1);
+	u32 first = min_t(u32, len, tcp_flow_export.size - at);
+
+	memcpy(tcp_flow_export.data + at, src, first);
+	memcpy(tcp_flow_export.data, src + first, len - first);
+}
+
+static inline void export_read(u64 off, u8 *dst, int len)
+{
+	u32 at = off & (tcp_flow_export.size - 1);
+	u32 first = min_t(u32, len, tcp_flow_export.size - at);
+
+	memcpy(dst, tcp_flow_export.data + at, first);
+	memcpy(dst + first, tcp_flow_export.data, len - first);
+}
+
+/*
+ * Reads the length of the record at off. Returns the size of the length
+ * prefix and stores the body length in len.
+ *
+ * Caller must hold tcp_flow_spy.lock
+ */
+static inline int export_record_len(u64 off, u32 *len)
+{
+	u8 prefix[2];
+	u64 v = 0;
+	const u8 *p;
+
+	export_read(off, prefix, sizeof(prefix));
+	p = get_varint(prefix, prefix + sizeof(prefix), &v);
+	*len = v;
+	return p ? p - prefix : 0;
+}
+
+static inline int export_pending(void)
+{
+	return tcp_flow_export.head != tcp_flow_export.tail;
+}
+
+/*
+ * Makes room by dropping or compacting the oldest exported record.
+ *
+ * Caller must hold tcp_flow_spy.lock
+ */
+static inline void export_discard_oldest(void)
+{
+	u64 off = tcp_flow_export.tail;
+	u32 len = 0;
+	int prefix = export_record_len(off, &len);
+
+	if (overflow == OVERFLOW_COMPACT) {
+		export_read(off + prefix, tcp_flow_export.oldest, len);
+		if (decode_flow_log(tcp_flow_export.oldest, len,
+					&tcp_flow_export.decoded))
+			compact_into_aggregate(&tcp_flow_export.decoded);
+		tcp_flow_spy.compacted++;
+	} else {
+		tcp_flow_spy.dropped++;
+	}
+
+	tcp_flow_export.tail = off + prefix + len;
+	tcp_flow_export.count--;
+}
+
+/*
+ * Appends log to the export buffer. Returns 0 when there is no room and
+ * the overflow policy does not allow making some.
+ *
+ * Caller must hold tcp_flow_spy.lock
+ */
+static inline int export_flow_log(struct tcp_flow_log *log)
+{
+	u8 *body = tcp_flow_export.body;
+	u8 prefix[2];
+	int len, prefix_len;
+
+	/* The u64 counters would tear on 32-bit without it */
+	spin_lock(&log->lock);
+	len = encode_flow_log(log, body);
+	spin_unlock(&log->lock);
+	prefix_len = put_varint(prefix, len) - prefix;
+
+	while (tcp_flow_export.size -
+			(tcp_flow_export.head - tcp_flow_export.tail) <
+			prefix_len + len) {
+		if (overflow == OVERFLOW_BLOCK || !export_pending())
+			return 0;
+		export_discard_oldest();
+	}
+
+	export_write(tcp_flow_export.head, prefix, prefix_len);
+	export_write(tcp_flow_export.head + prefix_len, body, len);
+	tcp_flow_export.head += prefix_len + len;
+	tcp_flow_export.count++;
+	return 1;
+}
+
+static struct genl_family tcpflowspy_genl_family = {
+	.id = GENL_ID_GENERATE,
+	.name = TCPFLOWSPY_GENL_NAME,
+	.version = TCPFLOWSPY_GENL_VERSION,
+	.maxattr = TCPFLOWSPY_ATTR_MAX,
+};
+
+static struct genl_multicast_group tcpflowspy_genl_mcgrp = {
+	.name = TCPFLOWSPY_GENL_MCGRP,
+};
+
+static inline int netlink_listening(void)
+{
+	return netlink && netlink_has_listeners(init_net.genl_sock,
+			tcpflowspy_genl_mcgrp.id);
+}
+
+static int netlink_put_flow(struct sk_buff *skb,
+		const struct tcp_flow_log *p, int finished, u64 now)
+{
+	struct nlattr *nest = nla_nest_start(skb, TCPFLOWSPY_ATTR_FLOW);
+
+	if (!nest)
+		return -EMSGSIZE;
+
+	if (nla_put_u8(skb, TCPFLOWSPY_FLOW_FINISHED, finished) ||
+	    nla_put_u64(skb, TCPFLOWSPY_FLOW_TSTAMP,
+		    to_real_time(now)) ||
+	    nla_put_u64(skb, TCPFLOWSPY_FLOW_FIRST_TSTAMP,
+		    to_real_time(p->first_packet_tstamp)) ||
+	    nla_put_u64(skb, TCPFLOWSPY_FLOW_DURATION,
+		    p->last_packet_tstamp - p->first_packet_tstamp) ||
+	    nla_put_be32(skb, TCPFLOWSPY_FLOW_SADDR, p->saddr) ||
+	    nla_put_be32(skb, TCPFLOWSPY_FLOW_DADDR, p->daddr) ||
+	    nla_put_be16(skb, TCPFLOWSPY_FLOW_SPORT, p->sport) ||
+	    nla_put_be16(skb, TCPFLOWSPY_FLOW_DPORT, p->dport) ||
+	    nla_put_u32(skb, TCPFLOWSPY_FLOW_RECV_COUNT, p->recv_count) ||
+	    nla_put_u64(skb, TCPFLOWSPY_FLOW_RECV_SIZE,
+		    p->recv_size) ||
+	    nla_put_u64(skb, TCPFLOWSPY_FLOW_SND_SIZE,
+		    p->snd_size) ||
+	    nla_put_u32(skb, TCPFLOWSPY_FLOW_RETRANSMISSIONS,
+		    p->total_retransmissions) ||
+	    nla_put_u32(skb, TCPFLOWSPY_FLOW_OUT_OF_ORDER,
+		    p->out_of_order_packets) ||
+	    nla_put_u32(skb, TCPFLOWSPY_FLOW_SND_CWND_CLAMP,
+		    p->snd_cwnd_clamp) ||
+	    nla_put_u32(skb, TCPFLOWSPY_FLOW_SSTHRESH, p->ssthresh) ||
+	    nla_put_u32(skb, TCPFLOWSPY_FLOW_SRTT, p->srtt) ||
+	    nla_put_u32(skb, TCPFLOWSPY_FLOW_RTO, p->rto) ||
+	    nla_put_u32(skb, TCPFLOWSPY_FLOW_LAST_CWND, p->last_cwnd) ||
+	    nla_put_u32(skb, TCPFLOWSPY_FLOW_BUFF_SIZE, p->buff_size) ||
+	    nla_put_u32(skb, TCPFLOWSPY_FLOW_MAX_BUFF_SIZE,
+		    p->max_buff_size) ||
+	    nla_put(skb, TCPFLOWSPY_FLOW_CWND_HISTOGRAM,
+		    sizeof(p->snd_cwnd_histogram), p->snd_cwnd_histogram))
+		goto cancel;
+
+	if (sample_ns) {
+		u32 first = sample_first(p);
+		u32 count = sample_count(p);
+		u32 i = 0;
+		struct nlattr *samples;
+		struct tcpflowspy_sample *bins;
+
+		if (nla_put_u32(skb, TCPFLOWSPY_FLOW_SAMPLE_MS, sample_ms) ||
+		    nla_put_u32(skb, TCPFLOWSPY_FLOW_SAMPLE_FIRST, first))
+			goto cancel;
+
+		samples = nla_reserve(skb, TCPFLOWSPY_FLOW_SAMPLES,
+				count * sizeof(*bins));
+		if (!samples)
+			goto cancel;
+
+		/* Straighten the ring out, oldest first */
+		bins = nla_data(samples);
+		for (i = 0; i < count; i++)
+			bins[i] = p->samples[(first + i) & (SAMPLE_BINS - 1)];
+	}
+
+	nla_nest_end(skb, nest);
+	return 0;
+cancel:
+	nla_nest_cancel(skb, nest);
+	return -EMSGSIZE;
+}
+
+/*
+ * Starts a batch in one of the spare buffers. The probes must not
+ * allocate 16KB with interrupts off, so they only use what the work
+ * put aside for them and drop flows when it runs out.
+ *
+ * Caller must hold tcp_flow_netlink.lock
+ */
+static int netlink_open_batch(void)
+{
+	tcp_flow_netlink.batch = skb_dequeue(&tcp_flow_netlink.spare);
+	if (!tcp_flow_netlink.batch)
+		return -ENOMEM;
+
+	tcp_flow_netlink.hdr = genlmsg_put(tcp_flow_netlink.batch, 0, 0,
+			&tcpflowspy_genl_family, 0, TCPFLOWSPY_CMD_FLOWS);
+	if (!tcp_flow_netlink.hdr) {
+		nlmsg_free(tcp_flow_netlink.batch);
+		tcp_flow_netlink.batch = NULL;
+		return -EMSGSIZE;
+	}
+	return 0;
+}
+
+/* Caller must hold tcp_flow_netlink.lock */
+static void netlink_close_batch(void)
+{
+	if (!tcp_flow_netlink.batch)
+		return;
+
+	genlmsg_end(tcp_flow_netlink.batch, tcp_flow_netlink.hdr);
+	skb_queue_tail(&tcp_flow_netlink.ready, tcp_flow_netlink.batch);
+	tcp_flow_netlink.batch = NULL;
+}
+
+/* Tops the spare buffers up, from process context */
+static void netlink_refill(void)
+{
+	struct sk_buff *skb;
+
+	while (skb_queue_len(&tcp_flow_netlink.spare) < NETLINK_SPARES) {
+		skb = genlmsg_new(NETLINK_BATCH_SIZE, GFP_KERNEL);
+		if (!skb)
+			break;
+		skb_queue_tail(&tcp_flow_netlink.spare, skb);
+	}
+}
+
+/* Multicasts the full batches and replaces their buffers */
+static void netlink_send_ready(void)
+{
+	struct sk_buff *skb;
+
+	while ((skb = skb_dequeue(&tcp_flow_netlink.ready))) {
+		int err = genlmsg_multicast(skb, 0, tcpflowspy_genl_mcgrp.id,
+				GFP_KERNEL);
+
+		/* -ESRCH only means the last subscriber just left */
+		if (!err)
+			tcp_flow_netlink.sent++;
+		else if (err != -ESRCH)
+			tcp_flow_netlink.dropped++;
+	}
+	netlink_refill();
+}
+
+/*
+ * Adds a flow to the current batch. Sending is left to the work, so this
+ * is safe from the receive path and under p->lock.
+ */
+static void netlink_publish(const struct tcp_flow_log *p, int finished,
+		u64 now)
+{
+	unsigned long flags;
+
+	if (!netlink_listening())
+		return;
+
+	spin_lock_irqsave(&tcp_flow_netlink.lock, flags);
+	if (!tcp_flow_netlink.batch && netlink_open_batch())
+		goto drop;
+
+	if (netlink_put_flow(tcp_flow_netlink.batch, p, finished, now)) {
+		netlink_close_batch();
+		schedule_work(&tcp_flow_netlink.send);
+
+		if (netlink_open_batch() || netlink_put_flow(
+					tcp_flow_netlink.batch, p, finished, now))
+			goto drop;
+	}
+	spin_unlock_irqrestore(&tcp_flow_netlink.lock, flags);
+	return;
+drop:
+	tcp_flow_netlink.dropped++;
+	spin_unlock_irqrestore(&tcp_flow_netlink.lock, flags);
+	schedule_work(&tcp_flow_netlink.send);
+}
+
+/*
+ * Publishes live flows that saw packets since the last pass. Each used
+ * list is walked in short steps: a step copies out up to
+ * NETLINK_LIVE_BATCH records under the arena lock and looks at no more
+ * than NETLINK_LIVE_VISIT, idle ones included. The copies are formatted
+ * after releasing it, with live_next marking where to pick up.
+ */
+static void netlink_publish_live(u64 now)
+{
+	struct tcp_flow_arena *arena;
+	struct tcp_flow_log *p;
+	unsigned long flags;
+	int node = 0, i, n, visited;
+
+	for_each_arena(node, arena) {
+		spin_lock_irqsave(&arena->lock, flags);
+		arena->live_next = arena->used;
+		while (arena->live_next) {
+			n = 0;
+			visited = 0;
+			for (p = arena->live_next; p && n < NETLINK_LIVE_BATCH &&
+			     visited < NETLINK_LIVE_VISIT;
+			     p = p->used_thread_next, visited++) {
+				if (p->last_packet_tstamp <=
+						tcp_flow_netlink.last_live)
+					continue;
+
+				spin_lock(&p->lock);
+				tcp_flow_netlink.live[n++] = *p;
+				spin_unlock(&p->lock);
+			}
+			arena->live_next = p;
+			spin_unlock_irqrestore(&arena->lock, flags);
+
+			for (i = 0; i < n; i++)
+				netlink_publish(&tcp_flow_netlink.live[i], 0,
+						now);
+
+			spin_lock_irqsave(&arena->lock, flags);
+		}
+		spin_unlock_irqrestore(&arena->lock, flags);
+	}
+	tcp_flow_netlink.last_live = now;
+}
+
+/*
+ * Runs every netlink_flush_ms, and right away when a batch fills up.
+ * Subscribers each get their copy of the multicast, so none of them can
+ * steal records from the others or from the proc reader.
+ */
+static void netlink_work_fn(struct work_struct *work)
+{
+	unsigned long flags;
+
+	if (live && netlink_listening())
+		netlink_publish_live(get_time(NULL));
+
+	spin_lock_irqsave(&tcp_flow_netlink.lock, flags);
+	netlink_close_batch();
+	spin_unlock_irqrestore(&tcp_flow_netlink.lock, flags);
+
+	netlink_send_ready();
+
+	schedule_delayed_work(&tcp_flow_netlink.work,
+			msecs_to_jiffies(netlink_flush_ms));
+}
+
+/* Sends a batch as soon as it fills up, between two flushes */
+static void netlink_send_fn(struct work_struct *work)
+{
+	netlink_send_ready();
+}
+
+static int netlink_init(void)
+{
+	int ret = 0;
+
+	spin_lock_init(&tcp_flow_netlink.lock);
+	skb_queue_head_init(&tcp_flow_netlink.ready);
+	skb_queue_head_init(&tcp_flow_netlink.spare);
+	INIT_DELAYED_WORK(&tcp_flow_netlink.work, netlink_work_fn);
+	INIT_WORK(&tcp_flow_netlink.send, netlink_send_fn);
+
+	if (!netlink)
+		return 0;
+
+	ret = genl_register_family(&tcpflowspy_genl_family);
+	if (ret)
+		return ret;
+
+	ret = genl_register_mc_group(&tcpflowspy_genl_family,
+			&tcpflowspy_genl_mcgrp);
+	if (ret) {
+		genl_unregister_family(&tcpflowspy_genl_family);
+		return ret;
+	}
+
+	netlink_refill();
+	schedule_delayed_work(&tcp_flow_netlink.work,
+			msecs_to_jiffies(netlink_flush_ms));
+	return 0;
+}
+
+/* Only once the probes are gone, nothing can publish anymore */
+static void netlink_exit(void)
+{
+	if (!netlink)
+		return;
+
+	cancel_delayed_work_sync(&tcp_flow_netlink.work);
+	cancel_work_sync(&tcp_flow_netlink.send);
+	kfree_skb(tcp_flow_netlink.batch);
+	tcp_flow_netlink.batch = NULL;
+	skb_queue_purge(&tcp_flow_netlink.ready);
+	skb_queue_purge(&tcp_flow_netlink.spare);
+	genl_unregister_family(&tcpflowspy_genl_family);
+}
+
+/*
+ * Snapshots a flow that is over into the export buffer and retires its
+ * record right away. Only when the buffer is full under
+ * OVERFLOW_BLOCK does the record wait on the finished list.
+ *
+ * The record must already be unhashed. It is published under its own
+ * lock, and tcp_flow_spy.lock is only taken for the export buffer that
+ * all nodes share.
+ */
+static inline void finish_flow_log(struct tcp_flow_log *log)
+{
+	struct tcp_flow_arena *arena = tcp_flow_spy.arenas[log->node];
+	unsigned long flags;
+	int exported;
+
+	spin_lock_irqsave(&log->lock, flags);
+	netlink_publish(log, 1, get_time(NULL));
+	spin_unlock_irqrestore(&log->lock, flags);
+
+	spin_lock_irqsave(&arena->lock, flags);
+	remove_from_used(log);
+	spin_unlock_irqrestore(&arena->lock, flags);
+
+	spin_lock_irqsave(&tcp_flow_spy.lock, flags);
+	exported = export_flow_log(log);
+	if (unlikely(!exported))
+		push_finished(log);
+	spin_unlock_irqrestore(&tcp_flow_spy.lock, flags);
+
+	if (likely(exported))
+		retire_log(log);
+}
+
+/* Caller must hold tcp_flow_spy.lock */
+static inline void flush_finished(void)
+{
+	struct tcp_flow_log *log;
+
+	while ((log = tcp_flow_spy.finished_tail) && export_flow_log(log)) {
+		unlink_finished(log);
+		retire_log(log);
+	}
+}
+
 
 
 /* Soheil: I could use inet hash function, but I prefer to have my own. */
@@ -140,13 +966,13 @@ static inline u32 skb_hash_function(__be32 saddr, __be32 daddr,
 	return h;
 }
 
-static inline struct hashtable_entry *get_entry_for_skb(
+static inline struct hashtable_entry *get_entry_for_skb(int node,
 		__be32 saddr, __be32 daddr, __be16 sport, __be16 dport)
 {
 	struct hashtable_entry *entry;
 
 	entry =
-		&(tcp_flow_hashtable.entries
+		&(tcp_flow_spy.arenas[node]->entries
 				[skb_hash_function(saddr, daddr, sport, dport)]
 				);
 	return entry;
@@ -211,21 +1037,163 @@ static inline void remove_from_hashentry(struct hashtable_entry *entry,
 	log->next = NULL;
 }
 
-static inline struct tcp_flow_log *remove_from_hashtable(
-		struct hashtable_entry *entry,
-		__be32 saddr, __be32 daddr, __be16 sport, __be16 dport)
+static inline void insert_into_hashtable(struct hashtable_entry *entry,
+		struct tcp_flow_log *log)
+{
+	if (unlikely(entry->tail))
+		entry->tail->next = log;
+	else
+		entry->head = log;
+
+	log->prev = entry->tail;
+	log->next = 0;
+	entry->tail = log;
+}
+
+/*
+ * With sk_key the record hangs off the socket: the bucket comes from the
+ * socket address and a chain entry matches on a single pointer compare.
+ */
+static inline struct hashtable_entry *get_entry_for_sk(int node,
+		const struct sock *sk)
+{
+	return &tcp_flow_spy.arenas[node]->entries
+		[hash_ptr(sk, tcp_flow_spy.sk_hash_bits)];
+}
+
+static inline struct tcp_flow_log *find_flow_log_for_sk(
+		struct hashtable_entry *entry, const struct sock *sk)
+{
+	struct tcp_flow_log *log_element = entry->head;
+
+	while (log_element && log_element->sk != sk)
+		log_element = log_element->next;
+	return log_element;
+}
+
+/*
+ * Looks the flow up in the table of one node, by sk when it is given
+ * and by the 4-tuple otherwise. With remove the record is unhashed too.
+ */
+static inline struct tcp_flow_log *lookup_on_node(int node, int remove,
+		const struct sock *sk, __be32 saddr, __be32 daddr,
+		__be16 sport, __be16 dport)
+{
+	struct hashtable_entry *entry;
+	struct tcp_flow_log *log;
+	unsigned long flags;
+
+	if (sk) {
+		entry = get_entry_for_sk(node, sk);
+		spin_lock_irqsave(&entry->lock, flags);
+		log = find_flow_log_for_sk(entry, sk);
+	} else {
+		entry = get_entry_for_skb(node, saddr, daddr, sport, dport);
+		spin_lock_irqsave(&entry->lock, flags);
+		log = find_flow_log_for_skb(entry, saddr, daddr, sport, dport);
+	}
+	if (remove)
+		remove_from_hashentry(entry, log);
+	spin_unlock_irqrestore(&entry->lock, flags);
+
+	return log;
+}
+
+/*
+ * Looks on every node, the local one first. Only for the rare paths that
+ * must find a flow wherever it is hashed: close, destroy and bootstrap.
+ * Packets only look on their own node, see adopt_flow_log().
+ */
+static inline struct tcp_flow_log *lookup_flow_log(int local, int remove,
+		const struct sock *sk, __be32 saddr, __be32 daddr,
+		__be16 sport, __be16 dport)
 {
+	struct tcp_flow_arena *arena;
 	struct tcp_flow_log *log;
+	int node = 0;
+
+	log = lookup_on_node(local, remove, sk, saddr, daddr, sport, dport);
+	if (likely(log))
+		return log;
+
+	for_each_arena(node, arena) {
+		if (node == local)
+			continue;
+		log = lookup_on_node(node, remove, sk,
+				saddr, daddr, sport, dport);
+		if (log)
+			break;
+	}
+	return log;
+}
 
-	log = find_flow_log_for_skb(entry, saddr, daddr, sport, dport);
-	remove_from_hashentry(entry, log);
+/*
+ * Moves a flow hashed on another node into the local table, so that its
+ * next packets find it on the first try. Flows get there when their
+ * packets move to another node or the bootstrap hashed them. A close
+ * racing the move can miss the record, which then expires instead.
+ */
+static struct tcp_flow_log *adopt_flow_log(int local,
+		const struct sock *sk, __be32 saddr, __be32 daddr,
+		__be16 sport, __be16 dport)
+{
+	struct tcp_flow_arena *arena;
+	struct hashtable_entry *entry;
+	struct tcp_flow_log *log = NULL;
+	unsigned long flags;
+	int node = 0;
+
+	for_each_arena(node, arena) {
+		if (node == local)
+			continue;
+		log = lookup_on_node(node, 1, sk, saddr, daddr, sport, dport);
+		if (log)
+			break;
+	}
+	if (!log)
+		return NULL;
+
+	entry = sk ? get_entry_for_sk(local, sk) :
+		get_entry_for_skb(local, saddr, daddr, sport, dport);
+	spin_lock_irqsave(&entry->lock, flags);
+	insert_into_hashtable(entry, log);
+	WRITE_ONCE(log->hash_node, local);
+	spin_unlock_irqrestore(&entry->lock, flags);
 
 	return log;
 }
 
+/*
+ * Unhashes a record found through the used list or on the receive path.
+ * Returns NULL when someone else already took it out to finish it. The
+ * record itself is looked for, not its key: another flow may be hashed
+ * under the same key by then.
+ */
+static inline struct tcp_flow_log *unhash_flow_log(struct tcp_flow_log *log)
+{
+	int node = READ_ONCE(log->hash_node);
+	struct hashtable_entry *entry;
+	struct tcp_flow_log *p;
+	unsigned long flags;
+
+	if (log->sk)
+		entry = get_entry_for_sk(node, log->sk);
+	else
+		entry = get_entry_for_skb(node, log->saddr, log->daddr,
+				log->sport, log->dport);
+
+	spin_lock_irqsave(&entry->lock, flags);
+	for (p = entry->head; p && p != log; p = p->next)
+		;
+	remove_from_hashentry(entry, p);
+	spin_unlock_irqrestore(&entry->lock, flags);
+
+	return p;
+}
+
 static inline void reinitialize_tcp_flow_log(struct tcp_flow_log *log,
 		__be32 saddr, __be32 daddr, __be16 sport, __be16 dport,
-		struct timespec tstamp)
+		u64 tstamp)
 {
 	int i = 0;
 
@@ -233,13 +1201,13 @@ static inline void reinitialize_tcp_flow_log(struct tcp_flow_log *log,
 		return;
 	log->first_packet_tstamp = tstamp;
 	log->last_packet_tstamp = tstamp;
-	log->last_printed_tstamp.tv_sec = 0;
-	log->last_printed_tstamp.tv_nsec = 0;
+	log->last_printed_tstamp = 0;
 
 	log->saddr = saddr;
 	log->daddr = daddr;
 	log->sport = sport;
 	log->dport = dport;
+	log->sk = NULL;
 
 	log->recv_count = 0;
 	log->snd_count = 0;
@@ -260,87 +1228,442 @@ static inline void reinitialize_tcp_flow_log(struct tcp_flow_log *log,
 	log->rto = 0;
 
 	log->used = 0;
+	log->traced = 0;
 
 	for (i = 0; i < NUMBER_OF_BUCKETS; i++)
 		log->snd_cwnd_histogram[i] = 0;
+
+	memset(log->samples, 0, sizeof(log->samples));
+	log->sample_index = 0;
+	log->sample_end = tstamp + sample_ns;
 }
 
-static inline void insert_into_hashtable(struct hashtable_entry *entry,
-		struct tcp_flow_log *log)
+static void free_arena_storage(struct tcp_flow_arena *arena)
 {
-	if (unlikely(entry->tail))
-		entry->tail->next = log;
-	else
-		entry->head = log;
+	u32 i = 0;
 
-	log->prev = entry->tail;
-	log->next = 0;
-	entry->tail = log;
+	if (!arena->storage)
+		return;
+
+	for (i = 0; i < arena->sections; i++)
+		kfree(arena->storage[i]);
+	kfree(arena->storage);
+	arena->storage = NULL;
 }
 
-static inline struct hashtable_entry *initialize_hashtable(u32 size)
+static void free_arena(struct tcp_flow_arena *arena)
 {
-	int i = 0;
+	if (!arena)
+		return;
 
-	tcp_flow_hashtable.entries =
-		kcalloc(size, sizeof(struct hashtable_entry), GFP_KERNEL);
+	free_arena_storage(arena);
+	vfree(arena->entries);
+	kfree(arena);
+}
+
+/*
+ * Allocates the sections of an arena on its node, in chunks of
+ * MAX_CONTINOUS records that leave less than a record of each
+ * SECTION_SIZE unused. kmalloc memory sits in the linear map, which is
+ * mapped with huge pages already. On error the caller frees what is
+ * there with free_arena_storage().
+ */
+static int alloc_arena_storage(struct tcp_flow_arena *arena, int node,
+		u32 records)
+{
+	u32 i = 0;
+
+	arena->sections = DIV_ROUND_UP(records, MAX_CONTINOUS);
+	/* kcalloc_node() is younger than the kernels we build on */
+	arena->storage = kzalloc_node(arena->sections *
+			sizeof(struct tcp_flow_log *), GFP_KERNEL, node);
+	if (!arena->storage)
+		return -ENOMEM;
+
+	for (i = 0; i < arena->sections; i++) {
+		arena->storage[i] = kzalloc_node(SECTION_SIZE,
+				GFP_KERNEL, node);
+		if (!arena->storage[i])
+			return -ENOMEM;
+	}
+	return 0;
+}
 
-	if (tcp_flow_hashtable.entries)
-		for (i = 0; i < size; i++)
-			spin_lock_init(&tcp_flow_hashtable.entries[i].lock);
+/* Arena of at least records records and its own hash table, on node */
+static struct tcp_flow_arena *alloc_arena(int node, u32 records)
+{
+	struct tcp_flow_arena *arena;
+	u32 i = 0, j = 0, buckets;
+
+	arena = kzalloc_node(sizeof(*arena), GFP_KERNEL, node);
+	if (!arena)
+		return NULL;
+	spin_lock_init(&arena->lock);
+
+	/* Sized from bufsize with sk_key, which can outgrow kmalloc */
+	buckets = sk_key ? 1U << tcp_flow_spy.sk_hash_bits : HASHTABLE_SIZE;
+	arena->entries = vmalloc_node(buckets *
+			sizeof(struct hashtable_entry), node);
+	if (!arena->entries)
+		goto err;
+	memset(arena->entries, 0, buckets * sizeof(struct hashtable_entry));
+	for (i = 0; i < buckets; i++)
+		spin_lock_init(&arena->entries[i].lock);
+
+	if (alloc_arena_storage(arena, node, records))
+		goto err;
+
+	for (i = 0; i < arena->sections; i++) {
+		for (j = 0; j < MAX_CONTINOUS; j++) {
+			struct tcp_flow_log *log = &arena->storage[i][j];
 
-	return tcp_flow_hashtable.entries;
+			spin_lock_init(&log->lock);
+			log->node = node;
+			log->next = arena->available;
+			arena->available = log;
+		}
+	}
+	arena->size = arena->free = arena->sections * MAX_CONTINOUS;
+	return arena;
+err:
+	free_arena(arena);
+	return NULL;
+}
+
+static void free_arenas(void)
+{
+	int node = 0;
+
+	if (!tcp_flow_spy.arenas)
+		return;
+
+	for_each_node(node)
+		free_arena(tcp_flow_spy.arenas[node]);
+	kfree(tcp_flow_spy.arenas);
+	tcp_flow_spy.arenas = NULL;
+}
+
+/*
+ * Splits bufsize records over the nodes online now. With sk_key every
+ * table gets a bucket per record of an arena, so a socket finds its
+ * record in O(1) without walking a chain.
+ */
+static int alloc_arenas(void)
+{
+	u32 records = DIV_ROUND_UP(bufsize, num_online_nodes());
+	int node = 0;
+
+	tcp_flow_spy.sk_hash_bits =
+		ilog2(roundup_pow_of_two(max_t(u32, records, 16)));
+
+	tcp_flow_spy.arenas = kcalloc(nr_node_ids,
+			sizeof(struct tcp_flow_arena *), GFP_KERNEL);
+	if (!tcp_flow_spy.arenas)
+		return -ENOMEM;
+
+	tcp_flow_spy.home_node = numa_node_id();
+	for_each_online_node(node) {
+		tcp_flow_spy.arenas[node] = alloc_arena(node, records);
+		if (!tcp_flow_spy.arenas[node]) {
+			free_arenas();
+			return -ENOMEM;
+		}
+	}
+	return 0;
 }
 
-static inline int tcp_flow_log_avail(void)
+static inline int trace_new_flow(__be16 sport, __be16 dport)
 {
-	return tcp_flow_spy.available != 0;
+	u16 trace_port = READ_ONCE(tcp_flow_trace.port);
+	u32 sample = READ_ONCE(tcp_flow_trace.sample);
+
+	if (!tcp_flow_trace.rings)
+		return 0;
+	if (trace_port && (ntohs(sport) == trace_port ||
+				ntohs(dport) == trace_port))
+		return 1;
+	return sample && random32() % sample == 0;
+}
+
+/*
+ * tcp_v4_do_rcv() also runs from __release_sock() in process context, so
+ * BHs are kept off while writing: a softirq on this CPU would otherwise
+ * take the same slot. With them off the local ring has a single writer.
+ */
+static inline void trace_segment(const struct tcp_flow_log *log,
+		const struct sock *sk, const struct sk_buff *skb,
+		const struct tcphdr *th, u64 now)
+{
+	struct tcp_trace_ring *ring;
+	struct tcp_trace_event *ev;
+	u64 head;
+
+	local_bh_disable();
+	ring = tcp_flow_trace.rings[smp_processor_id()];
+	head = ring->head;
+	ev = &ring->events[head & (trace_size - 1)];
+	ev->tstamp = now;
+	ev->saddr = log->saddr;
+	ev->daddr = log->daddr;
+	ev->sport = log->sport;
+	ev->dport = log->dport;
+	ev->seq = ntohl(th->seq);
+	ev->ack = ntohl(th->ack_seq);
+	ev->len = skb->len;
+	ev->snd_cwnd = tcp_sk(sk)->snd_cwnd;
+	ev->srtt = tcp_sk(sk)->srtt >> 3;
+	ev->wmem = sk->sk_wmem_queued;
+
+	smp_wmb();
+	WRITE_ONCE(ring->head, head + 1);
+	local_bh_enable();
+
+	if (waitqueue_active(&tcp_flow_trace.wait))
+		wake_up(&tcp_flow_trace.wait);
+}
+
+/*
+ * Every packet of a socket without a record would look for it on the
+ * other nodes, and in sk_key mode ask the pool for one. Remember the
+ * sockets that found none, so their packets skip both until records
+ * may have appeared, see forget_refused().
+ */
+static inline int sk_refused(const struct sock *sk)
+{
+	const struct refused_sk *r =
+		&tcp_flow_spy.refused[hash_ptr(sk, REFUSED_BITS)];
+
+	return READ_ONCE(r->sk) == sk &&
+		READ_ONCE(r->gen) == READ_ONCE(tcp_flow_spy.pool_gen);
+}
+
+/*
+ * Remembers sk as known to have no record. Returns whether it already
+ * was, so missed counts flows and not their retries.
+ */
+static inline int refuse_sk(const struct sock *sk)
+{
+	struct refused_sk *r =
+		&tcp_flow_spy.refused[hash_ptr(sk, REFUSED_BITS)];
+	int known = r->sk == sk;
+
+	WRITE_ONCE(r->sk, sk);
+	WRITE_ONCE(r->gen, tcp_flow_spy.pool_gen);
+	return known;
+}
+
+/* Caller must hold arena->lock */
+static inline struct tcp_flow_log *take_from_arena(
+		struct tcp_flow_arena *arena)
+{
+	struct tcp_flow_log *log = arena->available;
+
+	if (!log)
+		return NULL;
+
+	arena->available = log->next;
+	arena->free--;
+	add_in_used(log);
+	return log;
+}
+
+/*
+ * Takes a record for a new flow and puts it on the used list, from the
+ * arena of the local node while it lasts and from any other after that.
+ * Finished flows give their record back as soon as they are exported,
+ * so the pool only runs dry when there are more live flows than
+ * records, or under OVERFLOW_BLOCK. Only the arena locks are taken.
+ */
+static inline struct tcp_flow_log *get_available_log(int local,
+		const struct sock *sk)
+{
+	struct tcp_flow_arena *arena = tcp_flow_spy.arenas[local];
+	struct tcp_flow_arena *other;
+	struct tcp_flow_log *log;
+	unsigned long flags;
+	int node = 0;
+
+	spin_lock_irqsave(&arena->lock, flags);
+	log = take_from_arena(arena);
+	if (likely(log))
+		arena->local++;
+	spin_unlock_irqrestore(&arena->lock, flags);
+	if (likely(log))
+		return log;
+
+	/* Remote memory is still better than not seeing the flow */
+	for_each_arena(node, other) {
+		if (other == arena)
+			continue;
+		spin_lock_irqsave(&other->lock, flags);
+		log = take_from_arena(other);
+		spin_unlock_irqrestore(&other->lock, flags);
+		if (log)
+			break;
+	}
+
+	spin_lock_irqsave(&arena->lock, flags);
+	if (log)
+		arena->remote++;
+	else if (!sk || !refuse_sk(sk))
+		arena->missed++;
+	spin_unlock_irqrestore(&arena->lock, flags);
+	return log;
+}
+
+/*
+ * The bin now falls into. Bins are only moved on by packets, so a quiet
+ * flow pays nothing and a packet after a gap clears the bins it skipped.
+ *
+ * Caller must hold log->lock
+ */
+static inline struct tcpflowspy_sample *current_sample(
+		struct tcp_flow_log *log, u64 now)
+{
+	if (unlikely(now >= log->sample_end)) {
+		u64 skipped = div64_u64(now - log->sample_end, sample_ns) + 1;
+		u32 i = 0;
+
+		for (i = 1; i <= min_t(u64, skipped, SAMPLE_BINS); i++)
+			memset(sample_bin(log, log->sample_index + i), 0,
+					sizeof(struct tcpflowspy_sample));
+		log->sample_index += skipped;
+		log->sample_end += skipped * sample_ns;
+	}
+	return sample_bin(log, log->sample_index);
+}
+
+/*
+ * Takes a record for a new flow seen on node and hashes it into the
+ * table of that node, keyed by sk when it is given and by the 4-tuple
+ * otherwise.
+ */
+static inline struct tcp_flow_log *new_flow_log(int node, struct sock *sk,
+		__be32 saddr, __be32 daddr, __be16 sport, __be16 dport,
+		u64 now)
+{
+	struct hashtable_entry *entry;
+	struct tcp_flow_log *p;
+	unsigned long flags;
+
+	p = get_available_log(node, sk);
+	if (unlikely(!p)) {
+		tcp_flow_spy.last_update = now;
+		wake_up(&tcp_flow_spy.wait);
+		return NULL;
+	}
+
+	reinitialize_tcp_flow_log(p, saddr, daddr, sport, dport, now);
+	p->sk = sk;
+	p->hash_node = node;
+	p->traced = trace_new_flow(sport, dport);
+	entry = sk ? get_entry_for_sk(node, sk) :
+		get_entry_for_skb(node, saddr, daddr, sport, dport);
+	spin_lock_irqsave(&entry->lock, flags);
+	insert_into_hashtable(entry, p);
+	spin_unlock_irqrestore(&entry->lock, flags);
+
+	return p;
+}
+
+/*
+ * Reads the 4-tuple of sk, remote side first as on received packets.
+ * Returns 0 when the port filter does not want the socket.
+ */
+static inline int sk_flow_tuple(const struct sock *sk, __be32 *saddr,
+		__be32 *daddr, __be16 *sport, __be16 *dport)
+{
+	const struct inet_sock *inet = inet_sk(sk);
+
+#if SPY_COMPAT >= 34
+	*saddr = inet->inet_daddr;
+	*daddr = inet->inet_saddr;
+	*sport = inet->inet_dport;
+	*dport = inet->inet_sport;
+#else
+	*saddr = inet->daddr;
+	*daddr = inet->saddr;
+	*sport = inet->dport;
+	*dport = inet->sport;
+#endif
+
+	/* Only track if port matches */
+	return port == 0 || ntohs(*dport) == port || ntohs(*sport) == port;
+}
+
+/* The record attached to sk, creating one for a connected socket */
+static inline struct tcp_flow_log *flow_log_for_sk(struct sock *sk,
+		int node, u64 now)
+{
+	struct tcp_flow_log *p;
+	__be32 saddr, daddr;
+	__be16 sport, dport;
+
+	if (!sk_flow_tuple(sk, &saddr, &daddr, &sport, &dport))
+		return NULL;
+
+	/* Listeners only see handshakes, the child socket gets the flow */
+	if (sk->sk_state == TCP_LISTEN)
+		return NULL;
+
+	p = lookup_on_node(node, 0, sk, 0, 0, 0, 0);
+
+	/*
+	 * The child never sees a SYN itself, so a socket gets its record by
+	 * state instead. The rest only look further once per socket.
+	 */
+	if (likely(p) || !((1 << sk->sk_state) & SK_OPEN_STATES) ||
+			unlikely(sk_refused(sk)))
+		return p;
+
+	p = adopt_flow_log(node, sk, 0, 0, 0, 0);
+	if (p)
+		return p;
+
+	return new_flow_log(node, sk, saddr, daddr, sport, dport, now);
 }
 
 static int jtcp_v4_do_rcv(struct sock *sk, struct sk_buff *skb)
 {
 	const struct tcp_sock *tp = tcp_sk(sk);
 	const struct tcphdr *th = tcp_hdr(skb);
-	const struct iphdr *iph = ip_hdr(skb);
+	struct tcp_flow_log *p = NULL;
+	struct tcpflowspy_sample *bin = NULL;
 	unsigned long flags;
-	struct timespec now = get_time();
+	u64 now = get_time(skb);
+	int node = local_node();
+
+	if (sk_key) {
+		p = flow_log_for_sk(sk, node, now);
+		if (!p)
+			goto ret;
+	} else {
+		const struct iphdr *iph = ip_hdr(skb);
 
-	/* Only update if port matches */
-	if ((port == 0 || ntohs(th->dest) == port ||
-				ntohs(th->source) == port)) {
-		struct tcp_flow_log *p = NULL;
-		struct hashtable_entry *entry =
-			get_entry_for_skb(iph->saddr,
-					iph->daddr, th->source, th->dest);
+		/* Only update if port matches */
+		if (port != 0 && ntohs(th->dest) != port &&
+				ntohs(th->source) != port)
+			goto ret;
 
-		spin_lock_irqsave(&entry->lock, flags);
-		p = find_flow_log_for_skb(entry,
-				iph->saddr, iph->daddr, th->source, th->dest);
-		spin_unlock_irqrestore(&entry->lock, flags);
+		p = lookup_on_node(node, 0, NULL, iph->saddr, iph->daddr,
+				th->source, th->dest);
 
-		if (unlikely(!p))
+		/* Once per socket, a flow may be hashed on another node */
+		if (unlikely(!p) && !th->syn && !sk_refused(sk)) {
+			p = adopt_flow_log(node, NULL, iph->saddr, iph->daddr,
+					th->source, th->dest);
+			if (!p)
+				refuse_sk(sk);
+		}
+
+		if (unlikely(!p)) {
 			if (!th->syn)
 				goto ret;
 
-		spin_lock_irqsave(&tcp_flow_spy.lock, flags);
-		if (tcp_flow_log_avail()) {
-			p = tcp_flow_spy.available;
-			tcp_flow_spy.available = tcp_flow_spy.available->next;
-			add_in_used(p);
-		}
-		spin_unlock_irqrestore(&tcp_flow_spy.lock, flags);
-
-		if (likely(p)) {
-			reinitialize_tcp_flow_log(p,
-					iph->saddr,
-					iph->daddr, th->source, th->dest, now);
-			spin_lock_irqsave(&entry->lock, flags);
-			insert_into_hashtable(entry, p);
-			spin_unlock_irqrestore(&entry->lock, flags);
-		} else {
-			tcp_flow_spy.last_update = now;
-			wake_up(&tcp_flow_spy.wait);
-			goto ret;
+			p = new_flow_log(node, NULL, iph->saddr, iph->daddr,
+					th->source, th->dest, now);
+			if (unlikely(!p))
+				goto ret;
 		}
 	}
 
@@ -348,6 +1671,11 @@ static int jtcp_v4_do_rcv(struct sock *sk, struct sk_buff *skb)
 	p->last_packet_tstamp = now;
 	p->recv_count++;
 	p->recv_size += skb->len;
+
+	if (sample_ns) {
+		bin = current_sample(p, now);
+		bin->bytes_in += skb->len;
+	}
 	p->buff_size = sk->sk_wmem_queued;
 	p->max_buff_size = sk->sk_sndbuf;
 
@@ -367,25 +1695,36 @@ static int jtcp_v4_do_rcv(struct sock *sk, struct sk_buff *skb)
 		p->srtt = tp->srtt >> 3;
 		p->rto = inet_csk(sk)->icsk_rto;
 		p->rttvar = tp->rttvar;
+
+		if (bin) {
+			bin->snd_cwnd = p->last_cwnd;
+			bin->srtt = p->srtt;
+			/* Retransmissions before we saw the flow are not its */
+			if (likely(p->last_snd_seq))
+				bin->retransmissions += tp->total_retrans -
+					p->total_retransmissions;
+		}
+
 		p->total_retransmissions = tp->total_retrans;
-		if (likely(p->last_snd_seq && tp->snd_nxt > p->last_snd_seq))
+		if (likely(p->last_snd_seq && tp->snd_nxt > p->last_snd_seq)) {
 			p->snd_size += tp->snd_nxt - p->last_snd_seq;
+			if (bin)
+				bin->bytes_out += tp->snd_nxt - p->last_snd_seq;
+		}
 
 		p->last_snd_seq = tp->snd_nxt;
 	}
 	spin_unlock_irqrestore(&p->lock, flags);
 
+	if (unlikely(p->traced))
+		trace_segment(p, sk, skb, th, now);
+
 	if (is_finished(sk) || th->rst) {
-		spin_lock_irqsave(&entry->lock, flags);
-		remove_from_hashtable(entry,
-				iph->saddr, iph->daddr, th->source, th->dest);
-		spin_unlock_irqrestore(&entry->lock, flags);
+		struct tcp_flow_log *removed = unhash_flow_log(p);
 
-		spin_lock_irqsave(&tcp_flow_spy.lock, flags);
-		remove_from_used(p);
-		p->next = tcp_flow_spy.finished;
-		tcp_flow_spy.finished = p;
-		spin_unlock_irqrestore(&tcp_flow_spy.lock, flags);
+		/* Close or the reader may have beaten us to it */
+		if (removed)
+			finish_flow_log(removed);
 	}
 
 	if (likely(live || th->rst || is_finished(sk))) {
@@ -405,60 +1744,47 @@ static struct jprobe tcp_recv_jprobe = {
 	.entry = (kprobe_opcode_t *) jtcp_v4_do_rcv,
 };
 
-static void jtcp_close(struct sock *sk, long timeout)
+/* Finishes the record attached to sk in sk_key mode, if there is one */
+static inline void finish_flow_log_for_sk(const struct sock *sk)
 {
-	const struct inet_sock *inet = inet_sk(sk);
-	unsigned long flags;
+	struct tcp_flow_log *p;
 
-    __be16  sport =
-#if SPY_COMPAT >= 34
-                inet->inet_sport,
-#else
-                inet->sport,
-#endif
-            dport =
-#if SPY_COMPAT >= 34
-                inet->inet_dport;
-#else
-                inet->dport;
-#endif
+	p = lookup_flow_log(local_node(), 1, sk, 0, 0, 0, 0);
 
-    __be32  saddr =
-#if SPY_COMPAT >= 34
-                inet->inet_saddr,
-#else
-                inet->saddr,
-#endif
-            daddr =
-#if SPY_COMPAT >= 34
-                inet->inet_daddr;
-#else
-                inet->daddr;
-#endif
+	if (likely(p)) {
+		finish_flow_log(p);
+
+		tcp_flow_spy.last_update = get_time(NULL);
+		wake_up(&tcp_flow_spy.wait);
+	}
+}
 
-    if ((port == 0 || ntohs(sport) == port ||
-                ntohs(dport) == port)) {
+/* Finishes the record of sk in tuple mode, found by its 4-tuple */
+static inline void finish_flow_log_for_tuple(const struct sock *sk)
+{
+	struct tcp_flow_log *p;
+	__be32 saddr, daddr;
+	__be16 sport, dport;
 
-        struct tcp_flow_log* p = NULL;
-        struct hashtable_entry* entry =
-            get_entry_for_skb(saddr, daddr, sport, dport);
-        struct timespec now = get_time();
+	if (!sk_flow_tuple(sk, &saddr, &daddr, &sport, &dport))
+		return;
 
-        spin_lock_irqsave(&entry->lock, flags);
-        p = remove_from_hashtable(entry, saddr, daddr, sport, dport);
-        spin_unlock_irqrestore(&entry->lock, flags);
+	p = lookup_flow_log(local_node(), 1, NULL, saddr, daddr, sport, dport);
 
-        if (likely(p)) {
-            spin_lock_irqsave(&tcp_flow_spy.lock, flags);
-            remove_from_used(p);
-            p->next = tcp_flow_spy.finished;
-            tcp_flow_spy.finished = p;
-            spin_unlock_irqrestore(&tcp_flow_spy.lock, flags);
+	if (likely(p)) {
+		finish_flow_log(p);
 
-            tcp_flow_spy.last_update = now;
-            wake_up(&tcp_flow_spy.wait);
-        }
-    }
+		tcp_flow_spy.last_update = get_time(NULL);
+		wake_up(&tcp_flow_spy.wait);
+	}
+}
+
+static void jtcp_close(struct sock *sk, long timeout)
+{
+    if (sk_key)
+        finish_flow_log_for_sk(sk);
+    else
+        finish_flow_log_for_tuple(sk);
     jprobe_return();
 }
 
@@ -469,70 +1795,178 @@ static struct jprobe tcp_close_jprobe = {
     .entry = (kprobe_opcode_t*) jtcp_close,
 };
 
-static int tcpflowspy_open(struct inode * inode, struct file * file) {
-    struct timespec now = get_time();
-    tcp_flow_spy.start = now;
-    tcp_flow_spy.last_read = now;
-    tcp_flow_spy.last_update = now;
-    return 0;
+/*
+ * Sockets can go away without tcp_close(), e.g. children dropped before
+ * accept(). The record must not outlive the socket its key points to.
+ * It also catches records the bootstrap created while tcp_close() was
+ * already past its probe, waiting for the socket lock.
+ */
+static void jtcp_v4_destroy_sock(struct sock *sk)
+{
+	if (sk_key)
+		finish_flow_log_for_sk(sk);
+	else
+		finish_flow_log_for_tuple(sk);
+	jprobe_return();
 }
 
-static void inline tcpprobe_set_normalized_timespec(
-        struct timespec *ts, time_t sec, long nsec) {
-    while (nsec >= NSEC_PER_SEC) {
-        nsec -= NSEC_PER_SEC;
-        ++sec;
-    }
-    while (nsec < 0) {
-        nsec += NSEC_PER_SEC;
-        --sec;
-    }
-    ts->tv_sec = sec;
-    ts->tv_nsec = nsec;
-}
+static struct jprobe tcp_destroy_jprobe = {
+	.kp = {
+		.symbol_name = "tcp_v4_destroy_sock",
+	},
+	.entry = (kprobe_opcode_t *) jtcp_v4_destroy_sock,
+};
+
+/*
+ * Creates the record of a connection that was open before we were
+ * loaded. The socket lock keeps the receive path of sk out meanwhile,
+ * so the flow cannot get a second record from there. The record is
+ * hashed on the node of the worker and moves to the node of its
+ * packets on the first one, see adopt_flow_log().
+ */
+static void bootstrap_sk(struct sock *sk, u64 now)
+{
+	int node = local_node();
+	__be32 saddr, daddr;
+	__be16 sport, dport;
 
+	if (!sk_flow_tuple(sk, &saddr, &daddr, &sport, &dport))
+		return;
 
-static inline struct timespec tcpprobe_timespec_sub (
-         struct timespec lhs, struct timespec rhs) {
-    struct timespec ts_delta;
-    tcpprobe_set_normalized_timespec(&ts_delta, lhs.tv_sec - rhs.tv_sec,
-            lhs.tv_nsec - rhs.tv_nsec);
-    return ts_delta;
+	lock_sock(sk);
+	/* A dead socket is past tcp_close(), nothing would finish it */
+	if (((1 << sk->sk_state) & BOOTSTRAP_STATES) &&
+			!sock_flag(sk, SOCK_DEAD) &&
+			!lookup_flow_log(node, 0, sk_key ? sk : NULL,
+				saddr, daddr, sport, dport) &&
+			new_flow_log(node, sk_key ? sk : NULL,
+				saddr, daddr, sport, dport, now)) {
+		tcp_flow_bootstrap.flows++;
+		/* Its packets may have given up on finding it */
+		forget_refused();
+	}
+	release_sock(sk);
 }
 
+/*
+ * Walks bootstrap_batch buckets of the established hash. Under a bucket
+ * lock it only takes references, at most BOOTSTRAP_SOCKS per run, and
+ * records are created after the lock is gone. Like inet_diag it resumes
+ * a long chain by position, so a socket may be missed when the chain
+ * changes meanwhile.
+ */
+static void bootstrap_work_fn(struct work_struct *work)
+{
+	struct inet_hashinfo *hashinfo = &tcp_hashinfo;
+	u32 end = tcp_flow_bootstrap.buckets;
+	u64 now = get_time(NULL);
+	int count = 0, i = 0;
+
+	if (end - tcp_flow_bootstrap.bucket > bootstrap_batch)
+		end = tcp_flow_bootstrap.bucket + bootstrap_batch;
+
+	while (tcp_flow_bootstrap.bucket < end && count < BOOTSTRAP_SOCKS) {
+		u32 bucket = tcp_flow_bootstrap.bucket;
+		struct inet_ehash_bucket *head = &hashinfo->ehash[bucket];
+		spinlock_t *lock = inet_ehash_lockp(hashinfo, bucket);
+		struct hlist_nulls_node *node;
+		struct sock *sk;
+		u32 num = 0;
+		int full = 0;
+
+		if (hlist_nulls_empty(&head->chain)) {
+			tcp_flow_bootstrap.bucket++;
+			tcp_flow_bootstrap.skip = 0;
+			continue;
+		}
+
+		spin_lock_bh(lock);
+		sk_nulls_for_each(sk, node, &head->chain) {
+			if (num >= tcp_flow_bootstrap.skip) {
+				if (count == BOOTSTRAP_SOCKS) {
+					full = 1;
+					break;
+				}
+				/* Skips time-wait and request sockets too */
+				if (sk->sk_family == AF_INET &&
+						((1 << sk->sk_state) &
+						 BOOTSTRAP_STATES)) {
+					sock_hold(sk);
+					tcp_flow_bootstrap.socks[count++] = sk;
+				}
+			}
+			num++;
+		}
+		spin_unlock_bh(lock);
+
+		if (full) {
+			tcp_flow_bootstrap.skip = num;
+			break;
+		}
+		tcp_flow_bootstrap.bucket++;
+		tcp_flow_bootstrap.skip = 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		bootstrap_sk(tcp_flow_bootstrap.socks[i], now);
+		sock_put(tcp_flow_bootstrap.socks[i]);
+	}
+
+	if (tcp_flow_bootstrap.bucket < tcp_flow_bootstrap.buckets) {
+		schedule_work(&tcp_flow_bootstrap.work);
+		return;
+	}
 
-static inline int tcpprobe_timespec_larger(
-        struct timespec lhs, struct timespec rhs) {
-    int ret = lhs.tv_sec > rhs.tv_sec ||
-        (lhs.tv_sec == rhs.tv_sec && lhs.tv_nsec > rhs.tv_nsec);
-    return ret;
+	tcp_flow_bootstrap.end = get_time(NULL);
+	pr_info("tcpflowspy: bootstrap found %llu flows in %llu ms\n",
+			(unsigned long long) tcp_flow_bootstrap.flows,
+			(unsigned long long) div_u64(tcp_flow_bootstrap.end -
+				tcp_flow_bootstrap.start, NSEC_PER_MSEC));
+	if (tcp_flow_bootstrap.flows && live) {
+		tcp_flow_spy.last_update = tcp_flow_bootstrap.end;
+		wake_up(&tcp_flow_spy.wait);
+	}
 }
 
-#define EXPIRE_SKB (2*60)
+/* Runs once the probes are in, so nothing opened meanwhile is missed */
+static void bootstrap_start(void)
+{
+	INIT_WORK(&tcp_flow_bootstrap.work, bootstrap_work_fn);
+	if (!bootstrap || !bootstrap_batch)
+		return;
 
-static inline int tcpflowspy_sprint(struct tcp_flow_log* p, int finished,
-        char *tbuf, int n, struct timespec now) {
-    int size = 0;
-    struct timespec duration;
-    unsigned long flags;
+	tcp_flow_bootstrap.buckets = tcp_hashinfo.ehash_mask + 1;
+	tcp_flow_bootstrap.start = get_time(NULL);
+	schedule_work(&tcp_flow_bootstrap.work);
+}
 
-    if (unlikely(!p)) {
-        goto ret;
-    }
+static int tcpflowspy_open(struct inode * inode, struct file * file) {
+    u64 now = get_time(NULL);
+    tcp_flow_spy.start = now;
+    tcp_flow_spy.last_read = now;
+    tcp_flow_spy.last_update = now;
+    return 0;
+}
 
-    duration =
-        tcpprobe_timespec_sub(p->last_packet_tstamp, p->first_packet_tstamp);
+#define EXPIRE_SKB (2ULL * 60 * NSEC_PER_SEC)
 
-    spin_lock_irqsave(&p->lock, flags);
-    size = snprintf(tbuf, n,
-            "%lu%09lu (%d) %x:%u %x:%u %lu.%09lu %u %lu %lu %u %u %u %u %u %u %u %u %u %u,%u,%u,%u,%u,%u,%u,%u,%u,%u \n",
-            (unsigned long) now.tv_sec,
-            (unsigned long) now.tv_nsec,
+static inline int tcpflowspy_format(const struct tcp_flow_log* p,
+        int finished, char *tbuf, int n, u64 now) {
+    int size = 0;
+    u64 duration_sec;
+    u32 duration_nsec;
+    u32 i = 0;
+
+    duration_sec = div_u64_rem(p->last_packet_tstamp - p->first_packet_tstamp,
+            NSEC_PER_SEC, &duration_nsec);
+    size = scnprintf(tbuf, n,
+            "%llu (%d) %x:%u %x:%u %lu.%09lu %u %lu %lu %u %u %u %u %u %u %u %u %u %u,%u,%u,%u,%u,%u,%u,%u,%u,%u",
+            (unsigned long long) to_real_time(now),
             finished,
             (unsigned int) ntohl(p->saddr), ntohs(p->sport),
             (unsigned int) ntohl(p->daddr), ntohs(p->dport),
-            (unsigned long) duration.tv_sec,
-            (unsigned long) duration.tv_nsec,
+            (unsigned long) duration_sec,
+            (unsigned long) duration_nsec,
             p->recv_count,
             (unsigned long) p->recv_size,
             (unsigned long) p->snd_size,
@@ -548,148 +1982,213 @@ static inline int tcpflowspy_sprint(struct tcp_flow_log* p, int finished,
             p->snd_cwnd_histogram[4], p->snd_cwnd_histogram[5],
             p->snd_cwnd_histogram[6], p->snd_cwnd_histogram[7],
             p->snd_cwnd_histogram[8], p->snd_cwnd_histogram[9]);
+
+    /*
+     * Bin width and number of the first bin, then one
+     * in/out/retransmissions/cwnd/srtt group per bin, oldest first.
+     */
+    if (sample_ns) {
+        size += scnprintf(tbuf + size, n - size, " %u:%u",
+                sample_ms, sample_first(p));
+        for (i = sample_first(p); i <= p->sample_index; i++) {
+            const struct tcpflowspy_sample *bin =
+                &p->samples[i & (SAMPLE_BINS - 1)];
+
+            size += scnprintf(tbuf + size, n - size, "%c%u/%u/%u/%u/%u",
+                    i == sample_first(p) ? ' ' : ',',
+                    bin->bytes_in, bin->bytes_out, bin->retransmissions,
+                    bin->snd_cwnd, bin->srtt);
+        }
+    }
+    size += scnprintf(tbuf + size, n - size, " \n");
+
+    return size;
+}
+
+static inline int tcpflowspy_sprint(struct tcp_flow_log* p, int finished,
+        char *tbuf, int n, u64 now) {
+    int size = 0;
+    unsigned long flags;
+
+    if (unlikely(!p)) {
+        goto ret;
+    }
+
+    spin_lock_irqsave(&p->lock, flags);
+    size = tcpflowspy_format(p, finished, tbuf, n, now);
     spin_unlock_irqrestore(&p->lock, flags);
 
 ret:
     return size;
 }
 
+/*
+ * Copies the oldest exported record into body without consuming it.
+ * Returns its size including the length prefix, 0 if there is none.
+ *
+ * Caller must hold tcp_flow_spy.lock
+ */
+static inline int export_peek(u8 *body, u32 *len, u64 *off) {
+    int prefix;
+
+    if (!export_pending()) {
+        return 0;
+    }
 
-static inline struct tcp_flow_log*
-    get_next_finished_log_for_print(void) {
-    return tcp_flow_spy.finished;
+    *off = tcp_flow_export.tail;
+    prefix = export_record_len(*off, len);
+    export_read(*off + prefix, body, *len);
+    return prefix + *len;
 }
 
+
+/*
+ * Looks at the next live record, walking the used list of one arena
+ * after the other.
+ *
+ * Caller must hold tcp_flow_spy.lock
+ */
 static inline struct tcp_flow_log*
-                get_next_live_log_for_print(struct timespec expiration_time) {
+                get_next_live_log_for_print(u64 expiration_time) {
 
     struct tcp_flow_log* ret_for_print = NULL;
-    if (likely(tcp_flow_spy.used)) {
-        if (last_printed_flow_log == NULL) {
-            last_printed_flow_log = tcp_flow_spy.used;
+    struct tcp_flow_log* log = NULL;
+    int tries;
+
+    for (tries = 0; tries < nr_node_ids && !log; tries++) {
+        struct tcp_flow_arena *arena =
+            tcp_flow_spy.arenas[tcp_flow_spy.print_node];
+        int done = 1;
+
+        if (arena) {
+            spin_lock(&arena->lock);
+            log = arena->print_next ? arena->print_next : arena->used;
+            if (log) {
+                if (log->last_packet_tstamp > log->last_printed_tstamp ||
+                    expiration_time > log->last_packet_tstamp) {
+                    ret_for_print = log;
+                }
+                arena->print_next = log->used_thread_next;
+                done = !arena->print_next;
+            }
+            spin_unlock(&arena->lock);
         }
 
-        if (tcpprobe_timespec_larger(
-                    last_printed_flow_log->last_packet_tstamp,
-                    last_printed_flow_log->last_printed_tstamp) ||
-            tcpprobe_timespec_larger(
-                    expiration_time,
-                    last_printed_flow_log->last_packet_tstamp)
-           ) {
-            ret_for_print = last_printed_flow_log;
+        if (done) {
+            tcp_flow_spy.print_node =
+                (tcp_flow_spy.print_node + 1) % nr_node_ids;
         }
-
-        last_printed_flow_log = last_printed_flow_log->used_thread_next;
     }
     return ret_for_print;
 }
 
-#define PRINT_BUFF_SIZE 256
+#define PRINT_BUFF_SIZE 1536
 #define MIN_LOG_LENGTH 92
 
+/* Scratch of one read, too big for the stack */
+struct tcpflowspy_read_buf {
+    char text[PRINT_BUFF_SIZE];
+    u8 body[EXPORT_RECORD_MAX];
+    struct tcp_flow_log exported;
+};
+
 static ssize_t tcpflowspy_read(struct file *file, char __user *buf,
         size_t len, loff_t *ppos) {
+    struct tcpflowspy_read_buf *rb;
     int error = 0;
     size_t cnt = 0;
 
     if (!buf)
         return -EINVAL;
+
+    rb = kmalloc(sizeof(*rb), GFP_KERNEL);
+    if (!rb)
+        return -ENOMEM;
+
     while (cnt < len) {
-        char tbuf[PRINT_BUFF_SIZE];
         int width = 0;
         unsigned long flags;
-        struct timespec now;
+        u64 now;
         struct tcp_flow_log* log_for_print = NULL;
-        int finished = 0;
-        struct timespec expiration_time;
-        struct hashtable_entry* entry = NULL;
+        int record = 0;
+        u32 record_len = 0;
+        u64 record_off = 0;
+        u64 expiration_time;
 
         /* Wait for data in buffer */
         error = wait_event_interruptible(tcp_flow_spy.wait,
-                    tcp_flow_spy.finished != 0 ||
-                    tcpprobe_timespec_larger(
-                        tcp_flow_spy.last_update,
-                        tcp_flow_spy.last_read)
-                    );
+                    export_pending() ||
+                    tcp_flow_spy.last_update > tcp_flow_spy.last_read);
         if (error)
             break;
 
 
-        tcp_flow_spy.last_read = expiration_time = now = get_time();
+        tcp_flow_spy.last_read = now = get_time(NULL);
 
-        expiration_time.tv_sec -= EXPIRE_SKB;
-        if (unlikely(expiration_time.tv_sec < 0)) {
-            expiration_time.tv_sec = 0;
-        }
+        expiration_time = now > EXPIRE_SKB ? now - EXPIRE_SKB : 0;
 
+        /*
+         * Finished flows are only peeked at, they are consumed once they
+         * made it to userspace.
+         */
+        /* Keeps a live record from being reused, see retire_log() */
+        rcu_read_lock_sched();
         spin_lock_irqsave(&tcp_flow_spy.lock, flags);
-        log_for_print = get_next_finished_log_for_print();
-        if ((log_for_print == NULL) && live) {
+        record = export_peek(rb->body, &record_len, &record_off);
+        if (!record && live) {
             log_for_print = get_next_live_log_for_print(expiration_time);
-        } else {
-            finished = 1;
         }
         spin_unlock_irqrestore(&tcp_flow_spy.lock, flags);
 
-        if (log_for_print == NULL) {
+        if (record) {
+            if (decode_flow_log(rb->body, record_len, &rb->exported)) {
+                width = tcpflowspy_format(&rb->exported, 1,
+                        rb->text, sizeof(rb->text), now);
+            }
+        } else if (log_for_print == NULL) {
+            rcu_read_unlock_sched();
             continue;
-        }
-
-        entry = get_entry_for_skb(
-                    log_for_print->saddr,
-                    log_for_print->daddr,
-                    log_for_print->sport,
-                    log_for_print->dport);
-
-        if ( !finished && tcpprobe_timespec_larger(
-                    expiration_time,
-                    log_for_print->last_packet_tstamp)
-           ) {
-            finished = 1;
-            spin_lock_irqsave(&entry->lock, flags);
-            remove_from_hashtable
-                (entry, log_for_print->saddr, log_for_print->daddr,
-                 log_for_print->sport, log_for_print->dport);
-            spin_unlock_irqrestore(&entry->lock, flags);
-
-            spin_lock_irqsave(&tcp_flow_spy.lock, flags);
-            remove_from_used(log_for_print);
-            log_for_print->next = tcp_flow_spy.finished;
-            tcp_flow_spy.finished = log_for_print;
-            spin_unlock_irqrestore(&tcp_flow_spy.lock, flags);
-        }
-
-        width = tcpflowspy_sprint(log_for_print, finished,
-                tbuf, sizeof(tbuf), now);
-
-        if (width == 0) {
+        } else if (expiration_time > log_for_print->last_packet_tstamp) {
+            /* Export it, it is printed from the buffer like the rest */
+            if (unhash_flow_log(log_for_print))
+                finish_flow_log(log_for_print);
+            rcu_read_unlock_sched();
             continue;
+        } else {
+            width = tcpflowspy_sprint(log_for_print, 0,
+                    rb->text, sizeof(rb->text), now);
+            /* Stamped before the copy, which may sleep */
+            if (cnt + width < len)
+                log_for_print->last_printed_tstamp = now;
         }
-
-
-        if (cnt + width < len && finished) {
-            spin_lock_irqsave(&tcp_flow_spy.lock, flags);
-            tcp_flow_spy.finished = log_for_print->next;
-            log_for_print->next = tcp_flow_spy.available;
-            tcp_flow_spy.available = log_for_print;
-            log_for_print->used = 0;
-            spin_unlock_irqrestore(&tcp_flow_spy.lock, flags);
-        }
+        rcu_read_unlock_sched();
 
         if (cnt + width >= len) {
             break;
         }
 
-        log_for_print->last_printed_tstamp = now;
-
-        if (copy_to_user(buf + cnt, tbuf, width))
+        if (width && copy_to_user(buf + cnt, rb->text, width)) {
+            kfree(rb);
             return -EFAULT;
+        }
         cnt += width;
 
+        if (record) {
+            /* Unless the overflow policy got to it first */
+            spin_lock_irqsave(&tcp_flow_spy.lock, flags);
+            if (tcp_flow_export.tail == record_off) {
+                tcp_flow_export.tail += record;
+                tcp_flow_export.count--;
+            }
+            flush_finished();
+            spin_unlock_irqrestore(&tcp_flow_spy.lock, flags);
+        }
+
         if (cnt + MIN_LOG_LENGTH >= len) {
             break;
         }
     }
+    kfree(rb);
     return cnt == 0 ? error : cnt;
 }
 
@@ -699,44 +2198,308 @@ static const struct file_operations tcpflowspy_fops = {
     .read    = tcpflowspy_read,
 };
 
-static __init int tcpflowspy_init(void)
+static int tcpflowspy_stat_show(struct seq_file *m, void *v)
 {
-	int ret = -ENOMEM;
+	struct tcp_flow_arena *arena;
+	unsigned long flags;
+	u64 missed = 0;
 	int i = 0;
-	init_waitqueue_head(&tcp_flow_spy.wait);
-	spin_lock_init(&tcp_flow_spy.lock);
 
-	if (bufsize == 0)
+	/* seq_file buffers in memory, so printing under the lock is fine */
+	spin_lock_irqsave(&tcp_flow_spy.lock, flags);
+	seq_printf(m, "overflow %d\n", overflow);
+	seq_printf(m, "exported %u %llu/%u\n", tcp_flow_export.count,
+			(unsigned long long)
+			(tcp_flow_export.head - tcp_flow_export.tail),
+			tcp_flow_export.size);
+	seq_printf(m, "pending %u\n", tcp_flow_spy.finished_count);
+	seq_printf(m, "dropped %llu\n",
+			(unsigned long long) tcp_flow_spy.dropped);
+	seq_printf(m, "compacted %llu\n",
+			(unsigned long long) tcp_flow_spy.compacted);
+	for_each_arena(i, arena)
+		missed += arena->missed;
+	seq_printf(m, "missed %llu\n", (unsigned long long) missed);
+	seq_printf(m, "trace_lost %llu\n",
+			(unsigned long long) tcp_flow_trace.lost);
+	seq_printf(m, "netlink_sent %llu\n",
+			(unsigned long long) tcp_flow_netlink.sent);
+	seq_printf(m, "netlink_dropped %llu\n",
+			(unsigned long long) tcp_flow_netlink.dropped);
+	if (tcp_flow_bootstrap.buckets) {
+		u64 end = tcp_flow_bootstrap.end ?: get_time(NULL);
+
+		seq_printf(m, "bootstrap %u/%u flows %llu ms %llu %s\n",
+				tcp_flow_bootstrap.bucket,
+				tcp_flow_bootstrap.buckets,
+				(unsigned long long) tcp_flow_bootstrap.flows,
+				(unsigned long long) div_u64(end -
+					tcp_flow_bootstrap.start,
+					NSEC_PER_MSEC),
+				tcp_flow_bootstrap.end ? "done" : "running");
+	}
+
+	/* Flows of the node that got a local and a remote record */
+	for_each_arena(i, arena) {
+		spin_lock(&arena->lock);
+		seq_printf(m, "node %d %u/%u local %llu remote %llu\n",
+				i, arena->free, arena->size,
+				(unsigned long long) arena->local,
+				(unsigned long long) arena->remote);
+		spin_unlock(&arena->lock);
+	}
+
+	for (i = 0; i <= AGGREGATE_SIZE; i++) {
+		const struct tcp_port_aggregate *agg = i < AGGREGATE_SIZE ?
+			&tcp_flow_spy.aggregates[i] :
+			&tcp_flow_spy.aggregate_other;
+
+		if (!agg->flows)
+			continue;
+		/* The last line gathers the ports that found no slot */
+		seq_printf(m, "aggregate %s%u %u %llu %llu %llu %llu\n",
+				i == AGGREGATE_SIZE ? "other:" : "",
+				agg->port, agg->flows,
+				(unsigned long long) agg->recv_count,
+				(unsigned long long) agg->recv_size,
+				(unsigned long long) agg->snd_size,
+				(unsigned long long) agg->retransmissions);
+	}
+	spin_unlock_irqrestore(&tcp_flow_spy.lock, flags);
+	return 0;
+}
+
+static int tcpflowspy_stat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tcpflowspy_stat_show, NULL);
+}
+
+static const struct file_operations tcpflowspy_stat_fops = {
+	.owner	 = THIS_MODULE,
+	.open	 = tcpflowspy_stat_open,
+	.read	 = seq_read,
+	.llseek	 = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Copies the oldest unread event of a CPU ring into ev. Events the
+ * writer lapped while we were looking are counted as lost.
+ *
+ * Caller must hold trace_mutex
+ */
+static int trace_peek(struct tcp_trace_ring *ring,
+		struct tcp_trace_event *ev)
+{
+	for (;;) {
+		u64 head = READ_ONCE(ring->head);
+
+		smp_rmb();
+		if (ring->tail == head)
+			return 0;
+
+		/* The slot at head may be half written, skip it too */
+		if (head - ring->tail >= trace_size) {
+			tcp_flow_trace.lost += head - trace_size + 1 - ring->tail;
+			ring->tail = head - trace_size + 1;
+		}
+
+		*ev = ring->events[ring->tail & (trace_size - 1)];
+		smp_rmb();
+
+		/* Still intact if the writer has not come around again */
+		if (READ_ONCE(ring->head) - ring->tail < trace_size)
+			return 1;
+	}
+}
+
+#define TRACE_BUFF_SIZE 160
+
+static int trace_pending(void)
+{
+	int cpu = 0;
+
+	for_each_possible_cpu(cpu) {
+		struct tcp_trace_ring *ring = tcp_flow_trace.rings[cpu];
+
+		if (ring && READ_ONCE(ring->head) != ring->tail)
+			return 1;
+	}
+	return 0;
+}
+
+static ssize_t tcpflowspy_trace_read(struct file *file, char __user *buf,
+		size_t len, loff_t *ppos)
+{
+	size_t cnt = 0;
+	int error = 0;
+	int idle = 0;
+
+	if (!buf)
 		return -EINVAL;
 
-	bufsize = roundup_pow_of_two(bufsize);
+	mutex_lock(&trace_mutex);
+	while (cnt < len) {
+		struct tcp_trace_ring *ring;
+		struct tcp_trace_event ev;
+		char tbuf[TRACE_BUFF_SIZE];
+		int width = 0;
+
+		if (idle > nr_cpu_ids) {
+			if (cnt)
+				break;
+			mutex_unlock(&trace_mutex);
+			error = wait_event_interruptible(tcp_flow_trace.wait,
+					trace_pending());
+			mutex_lock(&trace_mutex);
+			if (error)
+				break;
+			idle = 0;
+		}
+
+		/* Round robin over CPUs so a busy one cannot starve the rest */
+		ring = tcp_flow_trace.rings[tcp_flow_trace.cpu];
+		if (!ring || !trace_peek(ring, &ev)) {
+			tcp_flow_trace.cpu = (tcp_flow_trace.cpu + 1) % nr_cpu_ids;
+			idle++;
+			continue;
+		}
+		idle = 0;
+
+		width = snprintf(tbuf, sizeof(tbuf),
+				"%llu %x:%u %x:%u %u %#x %#x %u %u %u\n",
+				(unsigned long long) to_real_time(ev.tstamp),
+				(unsigned int) ntohl(ev.saddr), ntohs(ev.sport),
+				(unsigned int) ntohl(ev.daddr), ntohs(ev.dport),
+				ev.len, ev.seq, ev.ack, ev.snd_cwnd, ev.srtt,
+				ev.wmem);
+
+		if (cnt + width > len)
+			break;
+
+		if (copy_to_user(buf + cnt, tbuf, width)) {
+			error = -EFAULT;
+			break;
+		}
+		ring->tail++;
+		cnt += width;
+	}
+	mutex_unlock(&trace_mutex);
+
+	return cnt == 0 ? error : cnt;
+}
 
-	tcp_flow_spy.storage =
-		kcalloc(SECTION_COUNT, sizeof(struct tcp_flow_log*), GFP_KERNEL);
+/*
+ * Accepts "port <n>", "sample <n>" or "off". Rules apply to flows
+ * created afterwards.
+ */
+static ssize_t tcpflowspy_trace_write(struct file *file,
+		const char __user *buf, size_t len, loff_t *ppos)
+{
+	char kbuf[32];
+	unsigned int value = 0;
 
-	if (!tcp_flow_spy.storage)
-		goto err0;
+	if (len >= sizeof(kbuf))
+		return -EINVAL;
+	if (copy_from_user(kbuf, buf, len))
+		return -EFAULT;
+	kbuf[len] = 0;
+
+	if (sscanf(kbuf, "port %u", &value) == 1 && value <= 0xffff) {
+		WRITE_ONCE(tcp_flow_trace.port, value);
+	} else if (sscanf(kbuf, "sample %u", &value) == 1) {
+		WRITE_ONCE(tcp_flow_trace.sample, value);
+	} else if (!strncmp(kbuf, "off", 3)) {
+		WRITE_ONCE(tcp_flow_trace.port, 0);
+		WRITE_ONCE(tcp_flow_trace.sample, 0);
+	} else {
+		return -EINVAL;
+	}
+	return len;
+}
 
+static const struct file_operations tcpflowspy_trace_fops = {
+	.owner	 = THIS_MODULE,
+	.read	 = tcpflowspy_trace_read,
+	.write	 = tcpflowspy_trace_write,
+};
 
-	for (i = 0; i < SECTION_COUNT; i++) {
+static void free_trace_rings(void)
+{
+	int cpu = 0;
 
-		tcp_flow_spy.storage[i] =
-			kcalloc(MAX_CONTINOUS, sizeof(struct tcp_flow_log), GFP_KERNEL);
+	if (!tcp_flow_trace.rings)
+		return;
 
-		if (!tcp_flow_spy.storage[i]) {
-			int j = 0;
-			for (j = 0; j < i; j++) {
-				kfree(tcp_flow_spy.storage[j]);
-			}
-			goto err0;
+	for_each_possible_cpu(cpu)
+		vfree(tcp_flow_trace.rings[cpu]);
+	kfree(tcp_flow_trace.rings);
+	tcp_flow_trace.rings = NULL;
+}
+
+static int alloc_trace_rings(void)
+{
+	unsigned long size;
+	int cpu = 0;
+
+	init_waitqueue_head(&tcp_flow_trace.wait);
+	tcp_flow_trace.sample = trace_sample;
+
+	if (trace_size == 0)
+		return 0;
+
+	trace_size = roundup_pow_of_two(trace_size);
+	size = sizeof(struct tcp_trace_ring) +
+		trace_size * sizeof(struct tcp_trace_event);
+
+	tcp_flow_trace.rings = kcalloc(nr_cpu_ids,
+			sizeof(struct tcp_trace_ring *), GFP_KERNEL);
+	if (!tcp_flow_trace.rings)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		tcp_flow_trace.rings[cpu] = vmalloc_node(size,
+				cpu_to_node(cpu));
+		if (!tcp_flow_trace.rings[cpu]) {
+			free_trace_rings();
+			return -ENOMEM;
 		}
+		memset(tcp_flow_trace.rings[cpu], 0, size);
 	}
+	return 0;
+}
+
+static __init int tcpflowspy_init(void)
+{
+	int ret = -ENOMEM;
+	init_waitqueue_head(&tcp_flow_spy.wait);
+	spin_lock_init(&tcp_flow_spy.lock);
+
+	if (bufsize == 0)
+		return -EINVAL;
+
+	tcp_flow_spy.real_offset =
+		ktime_to_ns(ktime_get_real()) - ktime_to_ns(ktime_get());
+	tcp_flow_spy.load_time = get_time(NULL);
+	sample_ns = (u64) sample_ms * NSEC_PER_MSEC;
+
+	bufsize = roundup_pow_of_two(bufsize);
+
+	if (exportsize < EXPORT_RECORD_MAX * 2)
+		return -EINVAL;
+
+	tcp_flow_export.size = roundup_pow_of_two(exportsize);
+	tcp_flow_export.data = vmalloc(tcp_flow_export.size);
+	if (!tcp_flow_export.data)
+		return -ENOMEM;
+
+	if (alloc_arenas())
+		goto err_export;
 
-	tcp_flow_spy.available = tcp_flow_spy.storage[0];
 	tcp_flow_spy.finished = NULL;
-	tcp_flow_spy.used = NULL;
+	tcp_flow_spy.finished_tail = NULL;
 
-	if (!initialize_hashtable(HASHTABLE_SIZE))
+	if (alloc_trace_rings())
 		goto err2;
 
 	if (!proc_net_fops_create(
@@ -746,27 +2509,63 @@ static __init int tcpflowspy_init(void)
 				procname, S_IRUSR | S_IRGRP | S_IROTH, &tcpflowspy_fops))
 		goto err2;
 
+	if (!proc_net_fops_create(
+#if SPY_COMPAT >= 32
+				&init_net,
+#endif
+				statname, S_IRUSR | S_IRGRP | S_IROTH,
+				&tcpflowspy_stat_fops))
+		goto err1;
+
+	/* Only offered when there is a ring to read from */
+	if (tcp_flow_trace.rings && !proc_net_fops_create(
+#if SPY_COMPAT >= 32
+				&init_net,
+#endif
+				tracename, S_IRUSR | S_IWUSR,
+				&tcpflowspy_trace_fops))
+		goto err_stat;
+
+	ret = netlink_init();
+	if (ret)
+		goto err_trace;
+
 	ret = register_jprobe(&tcp_recv_jprobe);
 	if (ret)
-		goto err1;
+		goto err_netlink;
 
 	ret = register_jprobe(&tcp_close_jprobe);
 	if (ret)
-		goto err1;
+		goto err_recv;
 
-	for (i = 0; i < SECTION_COUNT; i++) {
-		int j  = 0;
-		for (j = 0; j < MAX_CONTINOUS; j++) {
-			if (i != SECTION_COUNT - 1) {
-				tcp_flow_spy.storage[i][j].next = j < MAX_CONTINOUS - 1 ? &(tcp_flow_spy.storage[i][j+1]) : &(tcp_flow_spy.storage[i+1][0]);
-			} else {
-				tcp_flow_spy.storage[i][j].next = j < MAX_CONTINOUS - 1 ? &(tcp_flow_spy.storage[i][j+1]) : NULL;
-			}
-			spin_lock_init(&tcp_flow_spy.storage[i][j].lock);
-		}
-	}
-	pr_info("TCP flow spy registered (port=%d) bufsize=%u\n", port, bufsize);
+	ret = register_jprobe(&tcp_destroy_jprobe);
+	if (ret)
+		goto err_close;
+
+	bootstrap_start();
+
+	pr_info("TCP flow spy registered (port=%d) bufsize=%u overflow=%d nodes=%d\n",
+			port, bufsize, overflow, num_online_nodes());
 	return 0;
+err_close:
+	unregister_jprobe(&tcp_close_jprobe);
+err_recv:
+	unregister_jprobe(&tcp_recv_jprobe);
+err_netlink:
+	netlink_exit();
+err_trace:
+	if (tcp_flow_trace.rings)
+		proc_net_remove(
+#if SPY_COMPAT >= 32
+				&init_net,
+#endif
+				tracename);
+err_stat:
+	proc_net_remove(
+#if SPY_COMPAT >= 32
+			&init_net,
+#endif
+			statname);
 err1:
 	proc_net_remove(
 #if SPY_COMPAT >= 32
@@ -774,9 +2573,11 @@ err1:
 #endif
 			procname);
 err2:
-	for (i = 0; i < SECTION_COUNT; i++)
-		kfree(tcp_flow_spy.storage[i]);
-err0:
+	rcu_barrier_sched();
+	free_trace_rings();
+	free_arenas();
+err_export:
+	vfree(tcp_flow_export.data);
 	return ret;
 }
 
@@ -784,19 +2585,35 @@ module_init(tcpflowspy_init);
 
 static __exit void tcpflowspy_exit(void)
 {
-	int i = 0;
+	cancel_work_sync(&tcp_flow_bootstrap.work);
 
 	proc_net_remove(
 #if SPY_COMPAT >= 32
 			&init_net,
 #endif
 			procname);
+	proc_net_remove(
+#if SPY_COMPAT >= 32
+			&init_net,
+#endif
+			statname);
+	if (tcp_flow_trace.rings)
+		proc_net_remove(
+#if SPY_COMPAT >= 32
+				&init_net,
+#endif
+				tracename);
 
 	unregister_jprobe(&tcp_recv_jprobe);
 	unregister_jprobe(&tcp_close_jprobe);
-
-	for (i = 0; i < SECTION_COUNT; i++)
-		kfree(tcp_flow_spy.storage[i]);
+	unregister_jprobe(&tcp_destroy_jprobe);
+
+	/* Records still waiting to go back to their arena */
+	rcu_barrier_sched();
+	netlink_exit();
+	free_trace_rings();
+	free_arenas();
+	vfree(tcp_flow_export.data);
 
 	pr_info("TCP flow spy unregistered \n");
 }
@@ -13,26 +13,79 @@
 #ifndef TCP_FLOW_SPY_H
 #define TCP_FLOW_SPY_H
 
+#include "tcp_flow_spy_netlink.h"
+
+/*
+ * Kernel the module is built for, 2.6.SPY_COMPAT. It relies on jprobes
+ * and proc_net_fops_create(), so it builds on 2.6.32 up to 3.9 only and
+ * must not use helpers newer than that.
+ */
 #define SPY_COMPAT 35
 
+#ifndef READ_ONCE
+#define READ_ONCE(x) ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val) (ACCESS_ONCE(x) = (val))
+#endif
+
 #define HASHTABLE_SIZE 1357
-#define MAX_CONTINOUS 128
-#define SECTION_COUNT (bufsize / MAX_CONTINOUS)
+/*
+ * Records come in sections that fill the largest allocation the page
+ * allocator still tries hard to satisfy, whatever a record weighs.
+ */
+#define SECTION_SIZE (PAGE_SIZE << PAGE_ALLOC_COSTLY_ORDER)
+#define MAX_CONTINOUS (SECTION_SIZE / sizeof(struct tcp_flow_log))
 
 #define NUMBER_OF_BUCKETS   10
 
+/* Sample bins kept per flow, a power of two */
+#define SAMPLE_BINS 16
+
+/* What to do with finished records when the export buffer is full */
+#define OVERFLOW_BLOCK		0	/* keep them pinned in the pool */
+#define OVERFLOW_DROP		1	/* drop the oldest exported record */
+#define OVERFLOW_COMPACT	2	/* fold the oldest into a port aggregate */
+
+/* Payload of one generic netlink batch */
+#define NETLINK_BATCH_SIZE (16 * 1024)
+/* Batch buffers kept allocated for the probes */
+#define NETLINK_SPARES 4
+/* Live records copied out per hold of an arena lock */
+#define NETLINK_LIVE_BATCH 16
+/* Used records looked at per hold, idle ones included */
+#define NETLINK_LIVE_VISIT 64
+
+/* Upper bound of one packed record, see encode_flow_log() */
+#define EXPORT_RECORD_MAX 640
+
+#define AGGREGATE_SIZE 64
+
+/* Sockets remembered as refused a record, as a power of two */
+#define REFUSED_BITS 8
+
+/* Clock used for packet timestamps */
+#define TSTAMP_MONO	0
+#define TSTAMP_COARSE	1
+#define TSTAMP_SKB	2
+
 #define FINISHED_STATES \
 	(TCPF_CLOSE|TCPF_CLOSING|TCPF_TIME_WAIT|TCPF_LAST_ACK)
 
 #define is_finished(s) ((1 << s->sk_state) & FINISHED_STATES)
 
+/* States in which a socket keyed flow may start, i.e. before close() */
+#define SK_OPEN_STATES \
+	(TCPF_SYN_SENT|TCPF_SYN_RECV|TCPF_ESTABLISHED|TCPF_CLOSE_WAIT)
+
 
 struct tcp_flow_log {
-	struct timespec first_packet_tstamp;
-	struct timespec last_packet_tstamp;
-	struct timespec last_printed_tstamp;
+	/* Monotonic nanoseconds, see get_time() */
+	u64 first_packet_tstamp;
+	u64 last_packet_tstamp;
+	u64 last_printed_tstamp;
 	__be32 saddr, daddr;
 	__be16 sport, dport;
+	/* Owning socket when flows are keyed by socket, otherwise NULL */
+	struct sock *sk;
 	/* No of received packets */
 	u32 recv_count;
 	/* No of sent packets */
@@ -52,36 +105,208 @@ struct tcp_flow_log {
 	u32 last_cwnd;
 	u32 rto;
 	int used;
+	/* Node of the arena the record belongs to, never changes */
+	int node;
+	/* Node of the table it is hashed in, see adopt_flow_log() */
+	int hash_node;
+	/* Segments of this flow go to the trace ring */
+	int traced;
 	u32 snd_cwnd_histogram[NUMBER_OF_BUCKETS];
+	/* Ring of the last SAMPLE_BINS bins, see current_sample() */
+	struct tcpflowspy_sample samples[SAMPLE_BINS];
+	/* Number of the bin being filled and the time it ends */
+	u32 sample_index;
+	u64 sample_end;
 	spinlock_t lock;
 	u32 buff_size;
 	u32 max_buff_size;
+	/* Defers the return to the pool, see finish_flow_log() */
+	struct rcu_head rcu;
 	struct tcp_flow_log *used_thread_next;
 	struct tcp_flow_log *used_thread_prev;
 	struct tcp_flow_log *next;
 	struct tcp_flow_log *prev;
 };
 
+/* A socket known to have no record, see refuse_sk() */
+struct refused_sk {
+	const struct sock *sk;
+	/* tcp_flow_spy.pool_gen when it was found without one */
+	u32 gen;
+};
+
+/* Summary of finished flows compacted away under OVERFLOW_COMPACT */
+struct tcp_port_aggregate {
+	/* Service port in host order, 0 for an unused slot */
+	u16 port;
+	u32 flows;
+	u64 recv_count;
+	u64 recv_size;
+	u64 snd_size;
+	u64 retransmissions;
+};
+
 static struct {
 	spinlock_t lock;
 	wait_queue_head_t wait;
-	struct timespec	start;
-	struct timespec last_update;
-	struct timespec last_read;
-	struct tcp_flow_log *available;
-	struct tcp_flow_log **storage;
+	u64 start;
+	/* Exported timestamps are relative to this */
+	u64 load_time;
+	u64 last_update;
+	u64 last_read;
+	/* Wall-clock minus monotonic time, sampled at load */
+	u64 real_offset;
+	/* One per node online at load, NULL for the others */
+	struct tcp_flow_arena **arenas;
+	/* Arena of CPUs whose node has none */
+	int home_node;
+	/* log2 of the buckets of each table with sk_key, see alloc_arenas() */
+	u32 sk_hash_bits;
+	/*
+	 * Finished records that found no room in the export buffer, newest
+	 * at the head, oldest at the tail. Only used with OVERFLOW_BLOCK.
+	 */
 	struct tcp_flow_log *finished;
-	struct tcp_flow_log *used;
+	struct tcp_flow_log *finished_tail;
+	u32 finished_count;
+	/* Arena whose used list the reader is walking */
+	int print_node;
+	/* Overflow counters, reported through the stat file */
+	u64 dropped;
+	u64 compacted;
+	/* Bumped whenever records may have appeared, see forget_refused() */
+	u32 pool_gen;
+	struct refused_sk refused[1 << REFUSED_BITS];
+	struct tcp_port_aggregate aggregates[AGGREGATE_SIZE];
+	/* Flows whose port did not fit in aggregates */
+	struct tcp_port_aggregate aggregate_other;
 } tcp_flow_spy;
 
+/*
+ * Append-only byte ring of packed finished records, each one a varint
+ * length followed by the body. Offsets only grow and are masked on use.
+ * Protected by tcp_flow_spy.lock.
+ */
+static struct {
+	u8 *data;
+	u32 size;
+	u64 head;
+	u64 tail;
+	u32 count;
+	/* Scratch space, records are too big for the softirq stack */
+	u8 body[EXPORT_RECORD_MAX];
+	u8 oldest[EXPORT_RECORD_MAX];
+	struct tcp_flow_log decoded;
+} tcp_flow_export;
+
+/*
+ * Generic netlink batches. Flows are appended to batch until it is full,
+ * then it moves to ready and the send work multicasts it. Batches come
+ * from spare, which only process context fills.
+ */
+static struct {
+	spinlock_t lock;
+	struct sk_buff *batch;
+	void *hdr;
+	struct sk_buff_head ready;
+	struct sk_buff_head spare;
+	struct delayed_work work;
+	struct work_struct send;
+	/* Live flows idle since then were already published */
+	u64 last_live;
+	struct tcp_flow_log live[NETLINK_LIVE_BATCH];
+	u64 sent;
+	u64 dropped;
+} tcp_flow_netlink;
+
 struct hashtable_entry {
 	spinlock_t lock;
 	struct tcp_flow_log *head;
 	struct tcp_flow_log *tail;
 };
 
-static struct {
+/*
+ * Records and hash buckets of one NUMA node. A flow takes its record
+ * from the node of the CPU that saw its first packet and is hashed into
+ * the table of that node. RSS/RFS keep its later packets there, so the
+ * receive path stays on local memory and needs no global lock.
+ */
+struct tcp_flow_arena {
+	/* Protects the free and used lists, cursors and counters */
+	spinlock_t lock;
+	struct tcp_flow_log *available;
+	/* Records of this arena given to live flows */
+	struct tcp_flow_log *used;
+	/* Where the proc reader and the netlink work resume on used */
+	struct tcp_flow_log *print_next;
+	struct tcp_flow_log *live_next;
+	u32 free;
+	u32 size;
+	/* Sections of MAX_CONTINOUS records each */
+	struct tcp_flow_log **storage;
+	u32 sections;
 	struct hashtable_entry *entries;
-} tcp_flow_hashtable;
+	/* New flows of this node given a local, a remote and no record */
+	u64 local;
+	u64 remote;
+	u64 missed;
+};
+
+/* Sockets referenced per bootstrap run, see bootstrap_work_fn() */
+#define BOOTSTRAP_SOCKS 64
+
+/* Connections that are picked up at load */
+#define BOOTSTRAP_STATES (TCPF_ESTABLISHED|TCPF_CLOSE_WAIT)
+
+/*
+ * Walk of the established hash at load. The work runs a batch of buckets,
+ * saves where it stopped and queues itself again.
+ */
+static struct {
+	struct work_struct work;
+	/* Next bucket and the sockets of it already taken */
+	u32 bucket;
+	u32 skip;
+	u32 buckets;
+	u64 flows;
+	u64 start;
+	u64 end;
+	struct sock *socks[BOOTSTRAP_SOCKS];
+} tcp_flow_bootstrap;
+
+/* One traced segment, fixed size so the ring needs no framing */
+struct tcp_trace_event {
+	u64 tstamp;
+	__be32 saddr, daddr;
+	__be16 sport, dport;
+	u32 seq;
+	u32 ack;
+	u32 len;
+	u32 snd_cwnd;
+	u32 srtt;
+	u32 wmem;
+};
+
+/*
+ * Single producer ring, only written by the CPU that owns it. The reader
+ * detects events overwritten under it by re-checking head.
+ */
+struct tcp_trace_ring {
+	u64 head;
+	u64 tail;
+	struct tcp_trace_event events[0];
+};
+
+static struct {
+	struct tcp_trace_ring **rings;
+	wait_queue_head_t wait;
+	/* Flows created on this port are traced, 0 for none */
+	u16 port;
+	/* One in sample new flows is traced, 0 for none */
+	u32 sample;
+	u64 lost;
+	/* Next CPU the reader looks at */
+	int cpu;
+} tcp_flow_trace;
 
 #endif
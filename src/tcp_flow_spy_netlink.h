@@ -0,0 +1,85 @@
+/*
+ * In The Name Of God
+ * ========================================
+ * [] File Name : tcp_flow_spy_netlink.h
+ *
+ * [] Creation Date : 18-10-2026
+ *
+ * [] Created By : Parham Alvani (parham.alvani@gmail.com)
+ * =======================================
+*/
+/*
+ * Generic netlink interface of tcpflowspy, shared with userspace.
+ *
+ * Every TCPFLOWSPY_CMD_FLOWS message multicast to TCPFLOWSPY_GENL_MCGRP
+ * carries a batch of TCPFLOWSPY_ATTR_FLOW nests, one per flow, holding
+ * the fields /proc/net/tcpflowspy prints. Addresses and ports are in
+ * network order, timestamps are wall-clock nanoseconds.
+ */
+#ifndef TCP_FLOW_SPY_NETLINK_H
+#define TCP_FLOW_SPY_NETLINK_H
+
+#include <linux/types.h>
+
+#define TCPFLOWSPY_GENL_NAME	"tcpflowspy"
+#define TCPFLOWSPY_GENL_VERSION	1
+#define TCPFLOWSPY_GENL_MCGRP	"flows"
+
+enum {
+	TCPFLOWSPY_CMD_UNSPEC,
+	TCPFLOWSPY_CMD_FLOWS,
+	__TCPFLOWSPY_CMD_MAX,
+};
+#define TCPFLOWSPY_CMD_MAX (__TCPFLOWSPY_CMD_MAX - 1)
+
+enum {
+	TCPFLOWSPY_ATTR_UNSPEC,
+	TCPFLOWSPY_ATTR_FLOW,		/* nest of TCPFLOWSPY_FLOW_* */
+	__TCPFLOWSPY_ATTR_MAX,
+};
+#define TCPFLOWSPY_ATTR_MAX (__TCPFLOWSPY_ATTR_MAX - 1)
+
+enum {
+	TCPFLOWSPY_FLOW_UNSPEC,
+	TCPFLOWSPY_FLOW_FINISHED,	/* u8 */
+	TCPFLOWSPY_FLOW_TSTAMP,		/* u64, time of export */
+	TCPFLOWSPY_FLOW_FIRST_TSTAMP,	/* u64 */
+	TCPFLOWSPY_FLOW_DURATION,	/* u64, nanoseconds */
+	TCPFLOWSPY_FLOW_SADDR,		/* be32 */
+	TCPFLOWSPY_FLOW_DADDR,		/* be32 */
+	TCPFLOWSPY_FLOW_SPORT,		/* be16 */
+	TCPFLOWSPY_FLOW_DPORT,		/* be16 */
+	TCPFLOWSPY_FLOW_RECV_COUNT,	/* u32 */
+	TCPFLOWSPY_FLOW_RECV_SIZE,	/* u64 */
+	TCPFLOWSPY_FLOW_SND_SIZE,	/* u64 */
+	TCPFLOWSPY_FLOW_RETRANSMISSIONS,	/* u32 */
+	TCPFLOWSPY_FLOW_OUT_OF_ORDER,	/* u32 */
+	TCPFLOWSPY_FLOW_SND_CWND_CLAMP,	/* u32 */
+	TCPFLOWSPY_FLOW_SSTHRESH,	/* u32 */
+	TCPFLOWSPY_FLOW_SRTT,		/* u32 */
+	TCPFLOWSPY_FLOW_RTO,		/* u32 */
+	TCPFLOWSPY_FLOW_LAST_CWND,	/* u32 */
+	TCPFLOWSPY_FLOW_BUFF_SIZE,	/* u32 */
+	TCPFLOWSPY_FLOW_MAX_BUFF_SIZE,	/* u32 */
+	TCPFLOWSPY_FLOW_CWND_HISTOGRAM,	/* u32[], one per bucket */
+	TCPFLOWSPY_FLOW_SAMPLE_MS,	/* u32, width of a sample bin */
+	TCPFLOWSPY_FLOW_SAMPLE_FIRST,	/* u32, bin number of the first sample */
+	TCPFLOWSPY_FLOW_SAMPLES,	/* struct tcpflowspy_sample[], oldest first */
+	__TCPFLOWSPY_FLOW_MAX,
+};
+#define TCPFLOWSPY_FLOW_MAX (__TCPFLOWSPY_FLOW_MAX - 1)
+
+/*
+ * One fixed interval of a flow. Bin n covers the n-th sample interval
+ * after the first packet. srtt and snd_cwnd are the last values seen in
+ * the bin, the rest are totals over it.
+ */
+struct tcpflowspy_sample {
+	__u32 bytes_in;
+	__u32 bytes_out;
+	__u32 retransmissions;
+	__u32 snd_cwnd;
+	__u32 srtt;
+};
+
+#endif
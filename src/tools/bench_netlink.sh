@@ -0,0 +1,48 @@
+#!/bin/sh
+# In The Name Of God
+# ========================================
+# [] File Name : bench_netlink.sh
+#
+# [] Creation Date : 18-10-2026
+#
+# [] Created By : Parham Alvani (parham.alvani@gmail.com)
+# =======================================
+#
+# Export throughput of the proc file against generic netlink. A netperf
+# TCP_CRR load opens and closes flows as fast as it can while the proc
+# reader and SUBSCRIBERS netlink subscribers collect them side by side.
+# Each netlink subscriber should see every flow, while the proc reader
+# competes with nobody. Needs root and netperf.
+
+set -e
+
+DURATION=${DURATION:-20}
+SUBSCRIBERS=${SUBSCRIBERS:-2}
+RCVBUF=${RCVBUF:-4194304}
+KMOD=${KMOD:-../tcp_flow_spy.ko}
+SUB=${SUB:-./tcp_flow_spy_sub}
+OUT=$(mktemp -d)
+
+insmod "$KMOD" bufsize=16384 netlink=1
+netserver > /dev/null 2>&1
+
+i=0
+while [ "$i" -lt "$SUBSCRIBERS" ]; do
+	"$SUB" -r "$RCVBUF" -b "$DURATION" > "$OUT/sub$i" &
+	i=$((i + 1))
+done
+
+timeout "$DURATION" cat /proc/net/tcpflowspy | wc -l > "$OUT/proc" &
+netperf -H 127.0.0.1 -t TCP_CRR -l "$DURATION" -P 0 > "$OUT/netperf"
+wait
+
+echo "load:    $(awk 'NF { print $NF }' "$OUT/netperf") trans/s"
+echo "proc:    $(cat "$OUT/proc") flows"
+for f in "$OUT"/sub*; do
+	echo "netlink: $(cat "$f")"
+done
+grep netlink /proc/net/tcpflowspy_stat
+
+pkill netserver || true
+rmmod tcp_flow_spy
+rm -rf "$OUT"
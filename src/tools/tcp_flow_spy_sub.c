@@ -0,0 +1,384 @@
+/*
+ * In The Name Of God
+ * ========================================
+ * [] File Name : tcp_flow_spy_sub.c
+ *
+ * [] Creation Date : 18-10-2026
+ *
+ * [] Created By : Parham Alvani (parham.alvani@gmail.com)
+ * =======================================
+*/
+/*
+ * Subscribes to the tcpflowspy generic netlink group and prints flows in
+ * the format of /proc/net/tcpflowspy. Any number of subscribers can run
+ * next to each other and next to the proc reader.
+ *
+ * With -b it prints throughput numbers instead of flows.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+
+#include "../tcp_flow_spy_netlink.h"
+
+#define RECV_BUFF_SIZE (64 * 1024)
+#define NUMBER_OF_BUCKETS 10
+#define MAX_SAMPLES 64
+
+struct flow {
+	uint8_t finished;
+	uint64_t tstamp;
+	uint64_t duration;
+	uint32_t saddr, daddr;
+	uint16_t sport, dport;
+	uint32_t recv_count;
+	uint64_t recv_size;
+	uint64_t snd_size;
+	uint32_t u32[TCPFLOWSPY_FLOW_MAX + 1];
+	uint32_t histogram[NUMBER_OF_BUCKETS];
+	int nr_samples;
+	struct tcpflowspy_sample samples[MAX_SAMPLES];
+};
+
+static volatile sig_atomic_t exiting;
+
+static void sig_handler(int sig)
+{
+	exiting = 1;
+}
+
+#define for_each_attr(a, head, len) \
+	for (a = (struct nlattr *) (head); \
+	     (len) >= (int) NLA_HDRLEN && a->nla_len >= NLA_HDRLEN && \
+	     a->nla_len <= (len); \
+	     len -= NLA_ALIGN(a->nla_len), \
+	     a = (struct nlattr *) ((char *) a + NLA_ALIGN(a->nla_len)))
+
+static inline void *attr_data(struct nlattr *a)
+{
+	return (char *) a + NLA_HDRLEN;
+}
+
+static inline int attr_len(struct nlattr *a)
+{
+	return a->nla_len - NLA_HDRLEN;
+}
+
+static uint64_t attr_u64(struct nlattr *a)
+{
+	uint64_t v = 0;
+
+	memcpy(&v, attr_data(a), sizeof(v));
+	return v;
+}
+
+/* Resolves the family id and group id of tcpflowspy via nlctrl */
+static int resolve_family(int fd, uint16_t *family, uint32_t *group)
+{
+	struct {
+		struct nlmsghdr n;
+		struct genlmsghdr g;
+		char buf[256];
+	} req = {};
+	char buf[8192];
+	struct nlattr *a;
+	struct nlmsghdr *n;
+	int len;
+
+	req.n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	req.n.nlmsg_type = GENL_ID_CTRL;
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.g.cmd = CTRL_CMD_GETFAMILY;
+	req.g.version = 1;
+
+	a = (struct nlattr *) ((char *) &req + NLMSG_ALIGN(req.n.nlmsg_len));
+	a->nla_type = CTRL_ATTR_FAMILY_NAME;
+	a->nla_len = NLA_HDRLEN + sizeof(TCPFLOWSPY_GENL_NAME);
+	memcpy(attr_data(a), TCPFLOWSPY_GENL_NAME,
+			sizeof(TCPFLOWSPY_GENL_NAME));
+	req.n.nlmsg_len = NLMSG_ALIGN(req.n.nlmsg_len) + NLA_ALIGN(a->nla_len);
+
+	if (send(fd, &req, req.n.nlmsg_len, 0) < 0)
+		return -errno;
+
+	len = recv(fd, buf, sizeof(buf), 0);
+	if (len < 0)
+		return -errno;
+
+	n = (struct nlmsghdr *) buf;
+	if (!NLMSG_OK(n, len) || n->nlmsg_type == NLMSG_ERROR)
+		return -ENOENT;
+
+	*family = 0;
+	*group = 0;
+	len = n->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	for_each_attr(a, (char *) NLMSG_DATA(n) + GENL_HDRLEN, len) {
+		struct nlattr *grp, *ga;
+		int grp_len, ga_len;
+
+		if (a->nla_type == CTRL_ATTR_FAMILY_ID) {
+			*family = *(uint16_t *) attr_data(a);
+			continue;
+		}
+		if (a->nla_type != CTRL_ATTR_MCAST_GROUPS)
+			continue;
+
+		grp_len = attr_len(a);
+		for_each_attr(grp, attr_data(a), grp_len) {
+			uint32_t id = 0;
+			int match = 0;
+
+			ga_len = attr_len(grp);
+			for_each_attr(ga, attr_data(grp), ga_len) {
+				if (ga->nla_type == CTRL_ATTR_MCAST_GRP_ID)
+					id = *(uint32_t *) attr_data(ga);
+				else if (ga->nla_type == CTRL_ATTR_MCAST_GRP_NAME)
+					match = !strcmp(attr_data(ga),
+							TCPFLOWSPY_GENL_MCGRP);
+			}
+			if (match)
+				*group = id;
+		}
+	}
+	return *family && *group ? 0 : -ENOENT;
+}
+
+static void parse_flow(struct nlattr *nest, struct flow *f)
+{
+	struct nlattr *a;
+	int len = attr_len(nest);
+
+	memset(f, 0, sizeof(*f));
+	for_each_attr(a, attr_data(nest), len) {
+		switch (a->nla_type) {
+		case TCPFLOWSPY_FLOW_FINISHED:
+			f->finished = *(uint8_t *) attr_data(a);
+			break;
+		case TCPFLOWSPY_FLOW_TSTAMP:
+			f->tstamp = attr_u64(a);
+			break;
+		case TCPFLOWSPY_FLOW_DURATION:
+			f->duration = attr_u64(a);
+			break;
+		case TCPFLOWSPY_FLOW_SADDR:
+			f->saddr = *(uint32_t *) attr_data(a);
+			break;
+		case TCPFLOWSPY_FLOW_DADDR:
+			f->daddr = *(uint32_t *) attr_data(a);
+			break;
+		case TCPFLOWSPY_FLOW_SPORT:
+			f->sport = *(uint16_t *) attr_data(a);
+			break;
+		case TCPFLOWSPY_FLOW_DPORT:
+			f->dport = *(uint16_t *) attr_data(a);
+			break;
+		case TCPFLOWSPY_FLOW_RECV_SIZE:
+			f->recv_size = attr_u64(a);
+			break;
+		case TCPFLOWSPY_FLOW_SND_SIZE:
+			f->snd_size = attr_u64(a);
+			break;
+		case TCPFLOWSPY_FLOW_CWND_HISTOGRAM:
+			memcpy(f->histogram, attr_data(a),
+				attr_len(a) < (int) sizeof(f->histogram) ?
+				attr_len(a) : sizeof(f->histogram));
+			break;
+		case TCPFLOWSPY_FLOW_SAMPLES:
+			f->nr_samples = attr_len(a) / sizeof(f->samples[0]);
+			if (f->nr_samples > MAX_SAMPLES)
+				f->nr_samples = MAX_SAMPLES;
+			memcpy(f->samples, attr_data(a),
+				f->nr_samples * sizeof(f->samples[0]));
+			break;
+		default:
+			if (a->nla_type <= TCPFLOWSPY_FLOW_MAX &&
+					attr_len(a) == sizeof(uint32_t))
+				f->u32[a->nla_type] = *(uint32_t *) attr_data(a);
+		}
+	}
+}
+
+/* Same line as tcpflowspy_sprint() of the module */
+static void print_flow(const struct flow *f)
+{
+	const uint32_t *u = f->u32;
+	int i;
+
+	printf("%llu (%d) %x:%u %x:%u %lu.%09lu %u %lu %lu %u %u %u %u %u %u %u %u %u %u,%u,%u,%u,%u,%u,%u,%u,%u,%u",
+			(unsigned long long) f->tstamp,
+			f->finished,
+			ntohl(f->saddr), ntohs(f->sport),
+			ntohl(f->daddr), ntohs(f->dport),
+			(unsigned long) (f->duration / 1000000000ULL),
+			(unsigned long) (f->duration % 1000000000ULL),
+			u[TCPFLOWSPY_FLOW_RECV_COUNT],
+			(unsigned long) f->recv_size,
+			(unsigned long) f->snd_size,
+			u[TCPFLOWSPY_FLOW_RETRANSMISSIONS],
+			u[TCPFLOWSPY_FLOW_OUT_OF_ORDER],
+			u[TCPFLOWSPY_FLOW_SND_CWND_CLAMP],
+			u[TCPFLOWSPY_FLOW_SSTHRESH], u[TCPFLOWSPY_FLOW_SRTT],
+			u[TCPFLOWSPY_FLOW_RTO], u[TCPFLOWSPY_FLOW_LAST_CWND],
+			u[TCPFLOWSPY_FLOW_BUFF_SIZE],
+			u[TCPFLOWSPY_FLOW_MAX_BUFF_SIZE],
+			f->histogram[0], f->histogram[1],
+			f->histogram[2], f->histogram[3],
+			f->histogram[4], f->histogram[5],
+			f->histogram[6], f->histogram[7],
+			f->histogram[8], f->histogram[9]);
+
+	if (u[TCPFLOWSPY_FLOW_SAMPLE_MS]) {
+		printf(" %u:%u", u[TCPFLOWSPY_FLOW_SAMPLE_MS],
+				u[TCPFLOWSPY_FLOW_SAMPLE_FIRST]);
+		for (i = 0; i < f->nr_samples; i++)
+			printf("%c%u/%u/%u/%u/%u", i ? ',' : ' ',
+					f->samples[i].bytes_in,
+					f->samples[i].bytes_out,
+					f->samples[i].retransmissions,
+					f->samples[i].snd_cwnd,
+					f->samples[i].srtt);
+	}
+	printf(" \n");
+}
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-r rcvbuf] [-b seconds]\n"
+		"  -r  socket receive buffer in bytes\n"
+		"  -b  count flows for this long and print throughput\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	static char buf[RECV_BUFF_SIZE];
+	unsigned long long flows = 0, messages = 0, bytes = 0, overruns = 0;
+	double start, deadline = 0;
+	uint16_t family = 0;
+	uint32_t group = 0;
+	int rcvbuf = 0;
+	int bench = 0;
+	int fd, opt, err;
+
+	while ((opt = getopt(argc, argv, "r:b:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			rcvbuf = atoi(optarg);
+			break;
+		case 'b':
+			bench = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+	if (fd < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	err = resolve_family(fd, &family, &group);
+	if (err) {
+		fprintf(stderr, "%s family not found, is the module loaded: %s\n",
+				TCPFLOWSPY_GENL_NAME, strerror(-err));
+		return 1;
+	}
+
+	/* Force lets root go beyond net.core.rmem_max */
+	if (rcvbuf &&
+	    setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) &&
+	    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)))
+		perror("SO_RCVBUF");
+
+	if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+				&group, sizeof(group))) {
+		perror("NETLINK_ADD_MEMBERSHIP");
+		return 1;
+	}
+
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	start = now_seconds();
+	if (bench) {
+		struct timeval tv = { .tv_sec = 1 };
+
+		deadline = start + bench;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	}
+
+	while (!exiting && (!bench || now_seconds() < deadline)) {
+		struct nlmsghdr *n;
+		int len = recv(fd, buf, sizeof(buf), 0);
+
+		if (len < 0) {
+			/* The kernel had to drop batches we were too slow for */
+			if (errno == ENOBUFS)
+				overruns++;
+			else if (errno != EINTR && errno != EAGAIN)
+				break;
+			continue;
+		}
+		bytes += len;
+
+		for (n = (struct nlmsghdr *) buf; NLMSG_OK(n, len);
+				n = NLMSG_NEXT(n, len)) {
+			struct nlattr *a;
+			int alen;
+
+			if (n->nlmsg_type != family)
+				continue;
+			messages++;
+
+			alen = n->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+			for_each_attr(a, (char *) NLMSG_DATA(n) + GENL_HDRLEN,
+					alen) {
+				struct flow f;
+
+				if ((a->nla_type & NLA_TYPE_MASK) !=
+						TCPFLOWSPY_ATTR_FLOW)
+					continue;
+				flows++;
+				if (bench)
+					continue;
+				parse_flow(a, &f);
+				print_flow(&f);
+			}
+		}
+	}
+
+	if (bench) {
+		double elapsed = now_seconds() - start;
+
+		printf("flows %llu (%.0f/s) messages %llu (%.0f/s) "
+				"bytes %llu (%.1f MB/s) overruns %llu\n",
+				flows, flows / elapsed,
+				messages, messages / elapsed,
+				bytes, bytes / elapsed / 1e6, overruns);
+	}
+
+	close(fd);
+	return 0;
+}